@@ -0,0 +1,32 @@
+#!/bin/sh
+# Compare the ways udp_load can drive a device, side by side: one
+# send() per datagram as talker_dgram does, sendmmsg() batches, and
+# io_uring, plain and zero-copy, with and without SQPOLL.
+#
+# Each mode sends for a few seconds; its total line is printed. With
+# RX_NETNS and RX_IF set, a receiver in the same mode runs in that
+# network namespace meanwhile (see the comment at the top of
+# udp_load.c), and its total, with the latencies, is printed too.
+#
+# Usage: sh modes.sh interface dest-IP [secs] [extra udp_load options...]
+# e.g.   RX_NETNS=far RX_IF=sn1 sh modes.sh sn0 10.10.1.2 5 -t 2 -c 0
+# Must be run as root, from this directory.
+[ $# -lt 2 ] && { echo "usage: $0 interface dest-IP [secs] [options...]"; exit 1; }
+IF=$1
+DEST=$2
+SECS=${3:-5}
+shift 2
+[ $# -gt 0 ] && shift
+
+make udp_load || exit 1
+
+for mode in sendto mmsg uring uring-zc "uring -q" "uring-zc -q"; do
+	if [ -n "$RX_NETNS" ]; then
+		ip netns exec $RX_NETNS ./udp_load -R -i $RX_IF -m $mode \
+			-D $((SECS + 2)) $* | sed -n "s/^total/  rx/p" &
+		sleep 1
+	fi
+	printf "%-12s" "$mode"
+	./udp_load -S -i $IF -d $DEST -m $mode -D $SECS $* | sed -n "s/^total/  tx/p"
+	wait
+done
@@ -0,0 +1,913 @@
+/*
+ * udp_load.c -- multithreaded UDP load generator and sink for snull
+ *
+ * talker_dgram sends one datagram with one sendto(). This one keeps
+ * a device busy from userspace: N sender threads, each bound to the
+ * interface (SO_BINDTODEVICE) and pinned to a CPU, send with sendmmsg()
+ * batches, optionally as UDP GSO super-packets (UDP_SEGMENT). snull
+ * doesn't offer UDP segmentation (NETIF_F_GSO_UDP_L4), so the kernel's
+ * software GSO cuts them into datagrams before ndo_start_xmit: one
+ * trip down the stack for many datagrams. The receiver runs N
+ * threads on one SO_REUSEPORT port, reads with recvmmsg(), and works
+ * out the latency of every datagram from the send time it carries.
+ *
+ * Both sides print a line a second: packet and bit rate, and packets
+ * per system call, which is what tells syscall cost from driver cost:
+ * if the rate grows with the batch size, the syscalls were the limit.
+ *
+ * -m picks how the threads do their I/O, so the ways can be compared
+ * on the same device (see modes.sh):
+ *   sendto    one send()/recv() per datagram, talker_dgram's way
+ *   mmsg      sendmmsg()/recvmmsg() batches (the default)
+ *   uring     io_uring: 'batch' sends in flight; the receiver has one
+ *             multishot recv fed from a ring of provided buffers
+ *   uring-zc  the same, sending with IORING_OP_SEND_ZC from buffers
+ *             registered with the ring
+ * and -q adds an SQPOLL kernel thread to the io_uring modes, which then
+ * make no io_uring_enter() calls at all while busy.
+ *
+ * snull's two ends are on one host, so put the receiving device in a
+ * network namespace of its own (the latencies then compare
+ * CLOCK_MONOTONIC on both sides, which is the same clock):
+ *
+ *   ip netns add far; ip link set sn1 netns far
+ *   ip netns exec far ifconfig sn1 10.10.1.2 netmask 255.255.255.0
+ *   ifconfig sn0 10.10.1.1 netmask 255.255.255.0
+ *   ip netns exec far ./udp_load -R -i sn1 -t 4 &
+ *   ./udp_load -S -i sn0 -d 10.10.1.2 -t 4 -c 0 -b 64
+ *
+ * Must be run as root, for SO_BINDTODEVICE. io_uring is driven with
+ * the raw system calls, so no liburing is needed; the modes need
+ * Linux 6.0 or later.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>	/* UDP_SEGMENT */
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#define SERVERPORT	6100	/* the same as talker_dgram's */
+#define MAX_THREADS	256
+#define MAX_BATCH	1024
+#define MAX_SEGS	64	/* UDP GSO limit per send */
+#define MAX_DGRAM	65507	/* largest UDP payload over IPv4 */
+#define LAT_BUCKETS	64	/* log2 nanoseconds */
+#define RECV_BUFS	256	/* io_uring receive: provided buffers */
+
+/* What every datagram starts with */
+struct stamp {
+	uint64_t tx_ns;		/* CLOCK_MONOTONIC at send time */
+	uint32_t seq;		/* per sender thread */
+	uint32_t thread;
+};
+
+/*
+ * One thread. The counters have a single writer, the thread itself;
+ * the reporting loop reads them once a second.
+ */
+struct worker {
+	pthread_t tid;
+	int idx;
+	int cpu;		/* -1: not pinned */
+	uint32_t seq;
+	uint64_t pkts;
+	uint64_t bytes;
+	uint64_t calls;		/* system calls made */
+	uint64_t errors;
+	uint64_t lat[LAT_BUCKETS];
+} __attribute__((aligned(64)));
+
+#define COUNT(x, n) \
+	__atomic_store_n(&(x), __atomic_load_n(&(x), __ATOMIC_RELAXED) + (n), \
+			 __ATOMIC_RELAXED)
+#define READ(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+enum mode { MODE_SENDTO, MODE_MMSG, MODE_URING, MODE_URING_ZC };
+static const char *mode_names[] = { "sendto", "mmsg", "uring", "uring-zc" };
+
+static struct {
+	int sender;
+	const char *ifname;
+	struct sockaddr_in dest;
+	int port;
+	int threads;
+	int first_cpu;
+	int size;		/* UDP payload per datagram */
+	int batch;		/* messages per call, or in flight with io_uring */
+	int segs;		/* datagrams per message: > 1 is UDP GSO */
+	int duration;		/* seconds; 0 for until interrupted */
+	enum mode mode;
+	int sqpoll;
+} opt = {
+	.port = SERVERPORT,
+	.threads = 1,
+	.first_cpu = -1,
+	.size = 18,		/* a minimum-sized Ethernet frame */
+	.batch = 32,
+	.segs = 1,
+	.mode = MODE_MMSG,
+};
+
+static struct worker workers[MAX_THREADS];
+static volatile sig_atomic_t stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void pin(struct worker *w)
+{
+	cpu_set_t set;
+	int err;
+
+	if (w->cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err)
+		fprintf(stderr, "thread %d: can't run on CPU %d: %s\n",
+			w->idx, w->cpu, strerror(err));
+}
+
+static void *zalloc(size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (!p) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* A UDP socket bound to the interface; exits on failure */
+static int udp_socket(void)
+{
+	int fd, one = 1;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		perror("socket");
+		exit(1);
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, opt.ifname,
+		       strlen(opt.ifname) + 1) < 0) {
+		perror("setsockopt(SO_BINDTODEVICE)");
+		exit(1);
+	}
+	if (!opt.sender &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		perror("setsockopt(SO_REUSEPORT)");
+		exit(1);
+	}
+	return fd;
+}
+
+/* Stamp the 'segs' datagrams of one message */
+static void stamp_msg(struct worker *w, char *msg, uint64_t now)
+{
+	struct stamp *st;
+	int j;
+
+	for (j = 0; j < opt.segs; j++) {
+		st = (struct stamp *)(msg + j * opt.size);
+		st->tx_ns = now;
+		st->seq = w->seq++;
+		st->thread = w->idx;
+	}
+}
+
+/* Account for one received datagram */
+static void got_dgram(struct worker *w, const void *data, unsigned int len,
+		uint64_t now)
+{
+	const struct stamp *st = data;
+	int b;
+
+	if (len < sizeof(*st))
+		return;
+	b = now > st->tx_ns ? 64 - __builtin_clzll(now - st->tx_ns) : 0;
+	COUNT(w->lat[b < LAT_BUCKETS ? b : LAT_BUCKETS - 1], 1);
+}
+
+/* A send error we count and go on after, or exit on */
+static void send_error(int err, const char *what)
+{
+	/*
+	 * A full queue on the way is the device's limit, not ours; and
+	 * with no receiver yet, ICMP port unreachables come back.
+	 */
+	if (err == ENOBUFS || err == EAGAIN || err == EINTR ||
+	    err == ECONNREFUSED)
+		return;
+	fprintf(stderr, "%s: %s\n", what, strerror(err));
+	exit(1);
+}
+
+/*
+ * io_uring, by hand: the rings are mapped from the ring fd, and the
+ * head/tail indices shared with the kernel are read with acquire and
+ * written with release semantics.
+ */
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned sq_entries;
+	unsigned sqe_tail;	/* SQEs handed out; published on submit */
+	unsigned submitted;	/* ... and published so far */
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+		unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *uring_mmap(int fd, size_t len, off_t off)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, off);
+
+	if (p == MAP_FAILED) {
+		perror("mmap(io_uring)");
+		exit(1);
+	}
+	return p;
+}
+
+/* A ring of 'entries' SQEs and twice as many CQEs, using socket 'sock' */
+static void uring_init(struct uring *r, unsigned entries, int sock)
+{
+	struct io_uring_params p;
+	size_t sq_len, cq_len;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * 2;	/* a zero-copy send posts two */
+	if (opt.sqpoll) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;	/* ms */
+	}
+	r->fd = sys_io_uring_setup(entries, &p);
+	if (r->fd < 0) {
+		perror("io_uring_setup");
+		exit(1);
+	}
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_len > sq_len)
+			sq_len = cq_len;
+		sq = cq = uring_mmap(r->fd, sq_len, IORING_OFF_SQ_RING);
+	} else {
+		sq = uring_mmap(r->fd, sq_len, IORING_OFF_SQ_RING);
+		cq = uring_mmap(r->fd, cq_len, IORING_OFF_CQ_RING);
+	}
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->sqes = uring_mmap(r->fd, p.sq_entries * sizeof(struct io_uring_sqe),
+			     IORING_OFF_SQES);
+	r->sq_entries = p.sq_entries;
+	r->sqe_tail = r->submitted = *r->sq_tail;
+
+	/* The socket is fixed file 0: no fd lookup per request */
+	if (sys_io_uring_register(r->fd, IORING_REGISTER_FILES, &sock, 1) < 0) {
+		perror("io_uring_register(FILES)");
+		exit(1);
+	}
+}
+
+/* The next free SQE, cleared and set to use the socket; NULL if full */
+static struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	unsigned idx = r->sqe_tail & *r->sq_mask;
+	struct io_uring_sqe *sqe;
+
+	if (r->sqe_tail - head >= r->sq_entries)
+		return NULL;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = 0;
+	sqe->flags = IOSQE_FIXED_FILE;
+	r->sq_array[idx] = idx;
+	r->sqe_tail++;
+	return sqe;
+}
+
+/*
+ * Publish the new SQEs and, if 'wait', wait up to 100 ms for a
+ * completion. With SQPOLL the kernel thread picks them up by itself,
+ * and only needs a wakeup once it has gone idle; we spin on the CQ
+ * ring instead of waiting in the kernel, yielding the CPU in case the
+ * SQ thread shares it.
+ */
+static void uring_submit(struct worker *w, struct uring *r, int wait)
+{
+	struct __kernel_timespec ts = { .tv_nsec = 100000000 };
+	struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+	unsigned to_submit = r->sqe_tail - r->submitted;
+	unsigned flags = 0;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+	r->submitted = r->sqe_tail;
+	if (opt.sqpoll) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!(__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) &
+		      IORING_SQ_NEED_WAKEUP)) {
+			if (wait && *r->cq_head == __atomic_load_n(r->cq_tail,
+							__ATOMIC_ACQUIRE))
+				sched_yield();
+			return;
+		}
+		flags |= IORING_ENTER_SQ_WAKEUP;
+		to_submit = 0;
+		wait = 0;
+	}
+	if (wait)
+		flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	if (!to_submit && !flags)
+		return;
+	ret = sys_io_uring_enter(r->fd, to_submit, wait, flags,
+				 wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+	COUNT(w->calls, 1);
+	if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+		perror("io_uring_enter");
+		exit(1);
+	}
+}
+
+static void sender_sendto(struct worker *w, int fd)
+{
+	int msg_len = opt.size * opt.segs;
+	char *buf = zalloc(msg_len);
+
+	while (!stop) {
+		stamp_msg(w, buf, now_ns());
+		COUNT(w->calls, 1);
+		if (send(fd, buf, msg_len, 0) < 0) {
+			send_error(errno, "send");
+			COUNT(w->errors, 1);
+			continue;
+		}
+		COUNT(w->pkts, opt.segs);
+		COUNT(w->bytes, msg_len);
+	}
+}
+
+static void sender_mmsg(struct worker *w, int fd)
+{
+	int msg_len = opt.size * opt.segs;
+	char *buf = zalloc((size_t)opt.batch * msg_len);
+	struct mmsghdr *msgs = zalloc(opt.batch * sizeof(*msgs));
+	struct iovec *iov = zalloc(opt.batch * sizeof(*iov));
+	uint64_t now;
+	int i, n;
+
+	for (i = 0; i < opt.batch; i++) {
+		iov[i].iov_base = buf + (size_t)i * msg_len;
+		iov[i].iov_len = msg_len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (!stop) {
+		now = now_ns();
+		for (i = 0; i < opt.batch; i++)
+			stamp_msg(w, iov[i].iov_base, now);
+		n = sendmmsg(fd, msgs, opt.batch, 0);
+		COUNT(w->calls, 1);
+		if (n < 0) {
+			send_error(errno, "sendmmsg");
+			COUNT(w->errors, 1);
+			continue;
+		}
+		COUNT(w->pkts, (uint64_t)n * opt.segs);
+		COUNT(w->bytes, (uint64_t)n * msg_len);
+	}
+}
+
+/*
+ * 'batch' messages in flight, one buffer each. A plain send frees its
+ * buffer with its completion; a zero-copy one posts a second CQE, the
+ * notification, once the stack is done with the (registered) buffer.
+ */
+static void sender_uring(struct worker *w, int fd)
+{
+	int zc = opt.mode == MODE_URING_ZC;
+	int msg_len = opt.size * opt.segs;
+	char *buf = zalloc((size_t)opt.batch * msg_len);
+	struct iovec *iov = zalloc(opt.batch * sizeof(*iov));
+	int *free_slots = zalloc(opt.batch * sizeof(int));
+	int nfree = opt.batch;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct uring r;
+	unsigned head, tail;
+	uint64_t now;
+	int i, slot;
+
+	uring_init(&r, opt.batch, fd);
+	for (i = 0; i < opt.batch; i++) {
+		iov[i].iov_base = buf + (size_t)i * msg_len;
+		iov[i].iov_len = msg_len;
+		free_slots[i] = i;
+	}
+	if (zc && sys_io_uring_register(r.fd, IORING_REGISTER_BUFFERS, iov,
+					opt.batch) < 0) {
+		perror("io_uring_register(BUFFERS)");
+		exit(1);
+	}
+
+	while (!stop) {
+		now = now_ns();
+		while (nfree && (sqe = uring_sqe(&r))) {
+			slot = free_slots[--nfree];
+			stamp_msg(w, iov[slot].iov_base, now);
+			sqe->opcode = zc ? IORING_OP_SEND_ZC : IORING_OP_SEND;
+			sqe->addr = (uint64_t)(uintptr_t)iov[slot].iov_base;
+			sqe->len = msg_len;
+			sqe->user_data = slot;
+			if (zc) {
+				sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+				sqe->buf_index = slot;
+			}
+		}
+		uring_submit(w, &r, !nfree);
+
+		head = *r.cq_head;
+		tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &r.cqes[head & *r.cq_mask];
+			slot = cqe->user_data;
+			if (cqe->flags & IORING_CQE_F_NOTIF) {
+				free_slots[nfree++] = slot;
+				continue;
+			}
+			if (cqe->res < 0) {
+				send_error(-cqe->res, zc ? "send_zc" : "send");
+				COUNT(w->errors, 1);
+			} else {
+				COUNT(w->pkts, opt.segs);
+				COUNT(w->bytes, cqe->res);
+			}
+			/* A notification follows if F_MORE is set */
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				free_slots[nfree++] = slot;
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+static void *sender(void *arg)
+{
+	struct worker *w = arg;
+	int fd;
+
+	pin(w);
+	fd = udp_socket();
+	if (connect(fd, (struct sockaddr *)&opt.dest, sizeof(opt.dest)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	/* Every message a super-packet of 'segs' datagrams of 'size' */
+	if (opt.segs > 1 &&
+	    setsockopt(fd, SOL_UDP, UDP_SEGMENT, &opt.size, sizeof(opt.size)) < 0) {
+		perror("setsockopt(UDP_SEGMENT)");
+		exit(1);
+	}
+
+	switch (opt.mode) {
+	case MODE_SENDTO:
+		sender_sendto(w, fd);
+		break;
+	case MODE_MMSG:
+		sender_mmsg(w, fd);
+		break;
+	case MODE_URING:
+	case MODE_URING_ZC:
+		sender_uring(w, fd);
+		break;
+	}
+	close(fd);
+	return NULL;
+}
+
+static void receiver_recv(struct worker *w, int fd)
+{
+	char *buf = zalloc(MAX_DGRAM);
+	ssize_t len;
+
+	while (!stop) {
+		len = recv(fd, buf, MAX_DGRAM, 0);
+		COUNT(w->calls, 1);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("recv");
+			exit(1);
+		}
+		got_dgram(w, buf, len, now_ns());
+		COUNT(w->pkts, 1);
+		COUNT(w->bytes, len);
+	}
+}
+
+static void receiver_mmsg(struct worker *w, int fd)
+{
+	char *buf = zalloc((size_t)opt.batch * MAX_DGRAM);
+	struct mmsghdr *msgs = zalloc(opt.batch * sizeof(*msgs));
+	struct iovec *iov = zalloc(opt.batch * sizeof(*iov));
+	uint64_t now, bytes;
+	int i, n;
+
+	for (i = 0; i < opt.batch; i++) {
+		iov[i].iov_base = buf + (size_t)i * MAX_DGRAM;
+		iov[i].iov_len = MAX_DGRAM;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (!stop) {
+		/* Block for the first datagram only, then take what's there */
+		n = recvmmsg(fd, msgs, opt.batch, MSG_WAITFORONE, NULL);
+		COUNT(w->calls, 1);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("recvmmsg");
+			exit(1);
+		}
+		now = now_ns();
+		bytes = 0;
+		for (i = 0; i < n; i++) {
+			bytes += msgs[i].msg_len;
+			got_dgram(w, iov[i].iov_base, msgs[i].msg_len, now);
+		}
+		COUNT(w->pkts, n);
+		COUNT(w->bytes, bytes);
+	}
+}
+
+/*
+ * (Re)arm the multishot recv: one SQE, a CQE per datagram. If the SQ
+ * is full, push what is in it to the kernel until a slot frees up.
+ */
+static void recv_multishot(struct worker *w, struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	while (!(sqe = uring_sqe(r)))
+		uring_submit(w, r, 0);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = 0;
+}
+
+/*
+ * One multishot recv, which picks a buffer for each datagram from a
+ * ring of RECV_BUFS provided buffers; each goes back on the ring once
+ * looked at. The kernel ends the multishot (no F_MORE) if the ring
+ * runs dry, and we arm it again.
+ */
+static void receiver_uring(struct worker *w, int fd)
+{
+	struct io_uring_buf_reg reg;
+	struct io_uring_buf_ring *br;
+	struct io_uring_cqe *cqe;
+	struct uring r;
+	unsigned head, tail, bid;
+	uint16_t br_tail;
+	uint64_t now, pkts, bytes;
+	char *buf;
+	int i;
+
+	uring_init(&r, 64, fd);
+	buf = zalloc((size_t)RECV_BUFS * MAX_DGRAM);
+	br = mmap(NULL, RECV_BUFS * sizeof(struct io_uring_buf),
+		  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (br == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)br;
+	reg.ring_entries = RECV_BUFS;
+	reg.bgid = 0;
+	if (sys_io_uring_register(r.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		perror("io_uring_register(PBUF_RING)");
+		exit(1);
+	}
+	for (i = 0; i < RECV_BUFS; i++) {
+		br->bufs[i].addr = (uint64_t)(uintptr_t)(buf + (size_t)i * MAX_DGRAM);
+		br->bufs[i].len = MAX_DGRAM;
+		br->bufs[i].bid = i;
+	}
+	br_tail = RECV_BUFS;
+	__atomic_store_n(&br->tail, br_tail, __ATOMIC_RELEASE);
+
+	recv_multishot(w, &r);
+	while (!stop) {
+		uring_submit(w, &r, 1);
+
+		head = *r.cq_head;
+		tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		now = now_ns();
+		pkts = bytes = 0;
+		for (; head != tail; head++) {
+			cqe = &r.cqes[head & *r.cq_mask];
+			if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+				fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+				exit(1);
+			}
+			if (cqe->flags & IORING_CQE_F_BUFFER) {
+				bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				if (cqe->res >= 0) {
+					got_dgram(w, buf + (size_t)bid * MAX_DGRAM,
+						  cqe->res, now);
+					pkts++;
+					bytes += cqe->res;
+				}
+				i = br_tail++ & (RECV_BUFS - 1);
+				br->bufs[i].addr = (uint64_t)(uintptr_t)(buf + (size_t)bid * MAX_DGRAM);
+				br->bufs[i].len = MAX_DGRAM;
+				br->bufs[i].bid = bid;
+			}
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				recv_multishot(w, &r);
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+		__atomic_store_n(&br->tail, br_tail, __ATOMIC_RELEASE);
+		COUNT(w->pkts, pkts);
+		COUNT(w->bytes, bytes);
+	}
+}
+
+static void *receiver(void *arg)
+{
+	struct worker *w = arg;
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(opt.port),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	/* Wake up now and then to see if it's time to stop */
+	struct timeval tv = { .tv_usec = 100000 };
+	int fd;
+
+	pin(w);
+	fd = udp_socket();
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	switch (opt.mode) {
+	case MODE_SENDTO:
+		receiver_recv(w, fd);
+		break;
+	case MODE_MMSG:
+		receiver_mmsg(w, fd);
+		break;
+	case MODE_URING:
+	case MODE_URING_ZC:
+		receiver_uring(w, fd);
+		break;
+	}
+	close(fd);
+	return NULL;
+}
+
+/* Upper edge of the log2 bucket the 'permille'th latency falls into */
+static uint64_t percentile(const uint64_t *lat, uint64_t total, int permille)
+{
+	uint64_t seen = 0, rank = (total * permille + 999) / 1000;
+	int i;
+
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += lat[i];
+		if (seen >= rank)
+			return i ? 1ULL << i : 0;
+	}
+	return 0;
+}
+
+struct totals {
+	uint64_t pkts, bytes, calls, errors;
+	uint64_t lat[LAT_BUCKETS];
+};
+
+static void sum(struct totals *t)
+{
+	int i, j;
+
+	memset(t, 0, sizeof(*t));
+	for (i = 0; i < opt.threads; i++) {
+		t->pkts += READ(workers[i].pkts);
+		t->bytes += READ(workers[i].bytes);
+		t->calls += READ(workers[i].calls);
+		t->errors += READ(workers[i].errors);
+		for (j = 0; j < LAT_BUCKETS; j++)
+			t->lat[j] += READ(workers[i].lat[j]);
+	}
+}
+
+/*
+ * One line of the report, for what happened between 'a' and 'b'.
+ * With SQPOLL there may be no system calls at all: pkts/call is "-".
+ */
+static void report(const char *what, const struct totals *a,
+		   const struct totals *b, double secs)
+{
+	uint64_t pkts = b->pkts - a->pkts, calls = b->calls - a->calls;
+	uint64_t lat[LAT_BUCKETS];
+	char per_call[32] = "-";
+	int i;
+
+	if (calls)
+		snprintf(per_call, sizeof(per_call), "%.1f", (double)pkts / calls);
+	printf("%s %8.3f Mpps %8.3f Gbps %7s pkts/call",
+	       what, pkts / secs / 1e6, (b->bytes - a->bytes) * 8 / secs / 1e9,
+	       per_call);
+	if (opt.sender) {
+		printf(" %llu errors\n", (unsigned long long)(b->errors - a->errors));
+		return;
+	}
+	for (i = 0; i < LAT_BUCKETS; i++)
+		lat[i] = b->lat[i] - a->lat[i];
+	printf("  latency p50 %llu p99 %llu p999 %llu ns\n",
+	       (unsigned long long)percentile(lat, pkts, 500),
+	       (unsigned long long)percentile(lat, pkts, 990),
+	       (unsigned long long)percentile(lat, pkts, 999));
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s -S -i interface -d dest-IP [options]   (send)\n"
+		"       %s -R -i interface [options]              (receive)\n"
+		"  -p port      UDP port (%d)\n"
+		"  -t threads   sockets/threads (1)\n"
+		"  -c cpu       pin thread n to CPU cpu + n (not pinned)\n"
+		"  -s size      UDP payload bytes per datagram (18)\n"
+		"  -b batch     messages per call, or in flight with io_uring (32)\n"
+		"  -g segs      datagrams per message with UDP GSO (1: no GSO)\n"
+		"  -m mode      sendto, mmsg, uring or uring-zc (mmsg)\n"
+		"  -q           io_uring modes: SQPOLL\n"
+		"  -D secs      run this long (until interrupted)\n",
+		prog, prog, SERVERPORT);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct totals start, prev, cur;
+	uint64_t t0, t, last;
+	struct timespec next;
+	int c, i, err, ncpus;
+	const char *dest = NULL;
+	const char *mode = NULL;
+
+	opt.sender = -1;
+	while ((c = getopt(argc, argv, "SRi:d:p:t:c:s:b:g:m:qD:")) != -1) {
+		switch (c) {
+		case 'S': opt.sender = 1; break;
+		case 'R': opt.sender = 0; break;
+		case 'i': opt.ifname = optarg; break;
+		case 'd': dest = optarg; break;
+		case 'p': opt.port = atoi(optarg); break;
+		case 't': opt.threads = atoi(optarg); break;
+		case 'c': opt.first_cpu = atoi(optarg); break;
+		case 's': opt.size = atoi(optarg); break;
+		case 'b': opt.batch = atoi(optarg); break;
+		case 'g': opt.segs = atoi(optarg); break;
+		case 'm': mode = optarg; break;
+		case 'q': opt.sqpoll = 1; break;
+		case 'D': opt.duration = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (opt.sender < 0 || !opt.ifname || (opt.sender && !dest))
+		usage(argv[0]);
+	if (mode) {
+		for (i = 0; i < (int)(sizeof(mode_names) / sizeof(mode_names[0])); i++)
+			if (!strcmp(mode, mode_names[i]))
+				break;
+		if (i == sizeof(mode_names) / sizeof(mode_names[0]))
+			usage(argv[0]);
+		opt.mode = i;
+	}
+	if (opt.threads < 1 || opt.threads > MAX_THREADS ||
+	    opt.batch < 1 || opt.batch > MAX_BATCH ||
+	    opt.segs < 1 || opt.segs > MAX_SEGS ||
+	    opt.size < (int)sizeof(struct stamp) ||
+	    opt.size * opt.segs > MAX_DGRAM) {
+		fprintf(stderr, "%s: threads 1-%d, batch 1-%d, segs 1-%d, "
+			"size %zu and up, size * segs up to %d\n", argv[0],
+			MAX_THREADS, MAX_BATCH, MAX_SEGS, sizeof(struct stamp),
+			MAX_DGRAM);
+		exit(1);
+	}
+	if (opt.sender) {
+		opt.dest.sin_family = AF_INET;
+		opt.dest.sin_port = htons(opt.port);
+		if (inet_pton(AF_INET, dest, &opt.dest.sin_addr) != 1) {
+			fprintf(stderr, "%s: bad address %s\n", argv[0], dest);
+			exit(1);
+		}
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 0; i < opt.threads; i++) {
+		workers[i].idx = i;
+		workers[i].cpu = opt.first_cpu < 0 ? -1 : (opt.first_cpu + i) % ncpus;
+		err = pthread_create(&workers[i].tid, NULL,
+				     opt.sender ? sender : receiver, &workers[i]);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	printf("%s on %s (%s%s) with %d thread(s), batch %d, %d x %d bytes a message\n",
+	       opt.sender ? "sending" : "receiving", opt.ifname,
+	       mode_names[opt.mode], opt.sqpoll ? ", SQPOLL" : "", opt.threads,
+	       opt.batch, opt.segs, opt.size);
+
+	sum(&start);
+	prev = start;
+	t0 = last = now_ns();
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (!stop) {
+		next.tv_sec++;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) &&
+		       !stop)
+			;
+		sum(&cur);
+		t = now_ns();
+		report(opt.sender ? "tx" : "rx", &prev, &cur, (t - last) / 1e9);
+		fflush(stdout);
+		prev = cur;
+		last = t;
+		if (opt.duration && (t - t0) / 1000000000ULL >= (uint64_t)opt.duration)
+			stop = 1;
+	}
+
+	for (i = 0; i < opt.threads; i++)
+		pthread_join(workers[i].tid, NULL);
+	sum(&cur);
+	report("total", &start, &cur, (now_ns() - t0) / 1e9);
+	return 0;
+}
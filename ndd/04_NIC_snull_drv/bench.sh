@@ -0,0 +1,51 @@
+#!/bin/sh
+# Throughput and latency of snull, sn0 -> sn1, with the in-module
+# packet generator and sink (/sys/kernel/debug/snull/bench).
+#
+# The module is (re)loaded with the given parameters, then one run is
+# made per frame size; each prints Mpps, Gbps, drops and the p50, p99
+# and p999 TX-to-RX latency.
+#
+# Usage: sh bench.sh [count] [burst] [flows] [extra insmod params...]
+# e.g.   sh bench.sh 1000000 32 1 use_napi=1
+#        sh bench.sh 1000000 1 4 use_napi=1 num_queues=4
+#        SIZES="64 1514 9014" MTU=9000 sh bench.sh 1000000 32 1 max_mtu=9000
+# Must be run as root, from this directory.
+DRV=snull
+COUNT=${1:-1000000}
+BURST=${2:-32}
+FLOWS=${3:-1}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+SIZES=${SIZES:-"64 512 1514"}
+DBG=/sys/kernel/debug/$DRV
+export PATH=/sbin:/bin:/usr/sbin:/usr/bin:$PATH
+
+# Never with SNULL_DEBUG: a printk per frame would be what's measured
+make DEBUG= || exit 1
+
+mount | grep -q debugfs || mount -t debugfs none /sys/kernel/debug
+lsmod|grep $DRV >/dev/null && rmmod $DRV
+insmod ./$DRV.ko $* || exit 1
+for dev in sn0 sn1; do
+	[ -n "$MTU" ] && { ifconfig $dev mtu $MTU || exit 1; }
+	ifconfig $dev up
+done
+
+echo 0 > $DBG/bench_dev
+echo $COUNT > $DBG/bench_count
+echo $BURST > $DBG/bench_burst
+echo $FLOWS > $DBG/bench_flows
+
+printf "%6s %10s %8s %8s %8s %10s %10s %10s\n" \
+	size sent mpps gbps dropped p50_ns p99_ns p999_ns
+for size in $SIZES; do
+	echo $size > $DBG/bench_size
+	echo 1 > $DBG/bench || exit 1
+	awk -F': *' '{ v[$1] = $2 } END {
+		printf "%6s %10s %8s %8s %8s %10s %10s %10s\n", v["size"],
+			v["sent"], v["mpps"], v["gbps"], v["dropped"],
+			v["p50_ns"], v["p99_ns"], v["p999_ns"] }' $DBG/bench
+done
+rmmod $DRV
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Compare the receive throughput of snull's regular-interrupt path
+# (use_napi=0) against its NAPI path (use_napi=1).
+#
+# For each mode the module is (re)loaded, built without SNULL_DEBUG,
+# and the in-module packet generator (/sys/kernel/debug/snull/bench)
+# sends 'count' UDP frames from sn0 to sn1 as fast as the ring takes
+# them. The sink counts them where they would go up the stack, so the
+# receive path of the mode is what is measured. The rate at which
+# frames were received and the number lost are printed.
+#
+# Usage: sh napi_compare.sh [count] [burst] [extra insmod params...]
+# e.g.   sh napi_compare.sh 1000000 32 use_gro=0
+#        sh napi_compare.sh 1000000 1 napi_threaded=1
+# Must be run as root, from this directory.
+DRV=snull
+COUNT=${1:-1000000}
+BURST=${2:-32}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] && shift
+DBG=/sys/kernel/debug/$DRV
+export PATH=/sbin:/bin:/usr/sbin:/usr/bin:$PATH
+
+make DEBUG= || exit 1
+mount | grep -q debugfs || mount -t debugfs none /sys/kernel/debug
+
+run_mode()
+{
+	mode=$1
+	shift
+	lsmod|grep $DRV >/dev/null && rmmod $DRV
+	insmod ./$DRV.ko use_napi=$mode $* || exit 1
+	ifconfig sn0 up
+	ifconfig sn1 up
+
+	echo 0 > $DBG/bench_dev
+	echo $COUNT > $DBG/bench_count
+	echo $BURST > $DBG/bench_burst
+	echo 1 > $DBG/bench || exit 1
+	awk -F': *' -v mode=$mode '{ v[$1] = $2 } END {
+		secs = v["time_ns"] / 1e9
+		if (secs == 0)
+			secs = 1e-9
+		printf "use_napi=%s: %d sent, %d received in %.6f s = %d pps, %d dropped\n",
+			mode, v["sent"], v["received"], secs,
+			v["received"] / secs, v["dropped"] }' $DBG/bench
+	rmmod $DRV
+}
+
+echo "$COUNT frames in bursts of $BURST per mode ..."
+run_mode 0 $*
+run_mode 1 $*
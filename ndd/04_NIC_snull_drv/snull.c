@@ -16,6 +16,51 @@
  *
  * o ported to work on recent kernels; tested on 2.6.35
  * o ping'ing the interface did not work straight off; modified slightly
+ *   (now an echo reflector: see echo_reflect)
+ * o multi-queue: 'num_queues' TX/RX queue pairs per device, each with its
+ *   own packet pool, receive list, lock and interrupt vector
+ * o the packet pool is a power-of-two descriptor ring with lock-free TX
+ *   side and stop/wake thresholds instead of a locked linked list
+ * o received packets are kept in FIFO order, and use_napi=1 is a working
+ *   NAPI receive path (napi_schedule/napi_complete_done, budget respected)
+ * o zero-copy receive: frames are written into page_pool pages of the
+ *   receiving queue and the skb is built around them with build_skb()
+ * o native XDP (use_napi=1): DROP/PASS/TX/REDIRECT run on the ring page
+ *   before an skb exists; ndo_xdp_xmit makes snull a redirect target
+ * o AF_XDP zero-copy: a socket bound to a queue receives straight into
+ *   its umem and transmits from it, driven by NAPI and ndo_xsk_wakeup
+ * o per-CPU 64-bit statistics, summed up in ndo_get_stats64
+ * o interrupt moderation: an hrtimer per queue batches RX and TX-done
+ *   interrupts by time and frame count (ethtool -c/-C, adaptive mode)
+ * o link emulation: rate, delay/jitter, random or Gilbert-Elliott loss
+ *   and reordering on the wire, set in /sys/class/net/snX/link/
+ * o 'num_devs' devices, wired up in pairs or, with l2_switch=1, as the
+ *   ports of one MAC-learning switch; each may live in its own netns
+ * o scatter-gather, checksum offload and TSO/TSO6: the "hardware"
+ *   gathers skb frags, fills in checksums and segments on the wire
+ * o GRO on the NAPI receive path (use_gro, on by default)
+ * o jumbo frames: 'max_mtu' sizes the receive pages (higher-order ones
+ *   beyond 1500) and is the device's max_mtu; any MTU up to it can be
+ *   set on a running interface
+ * o software RSS: a Toeplitz hash of the IP addresses and ports picks
+ *   the receiving queue through an indirection table (ethtool -x/-X)
+ *   and ends up in skb->hash
+ * o BQL, and a TX doorbell held back while netdev_xmit_more() says more
+ *   is coming: a qdisc bulk dequeue costs one kick and one TX-done
+ * o threaded NAPI (napi_threaded, or /sys/class/net/snX/threaded) and
+ *   busy polling: received skbs carry the queue's NAPI id
+ * o hardware timestamps (SIOCSHWTSTAMP): TX when a frame goes on the
+ *   wire, RX when it lands in the receive buffer, from CLOCK_REALTIME
+ * o ethtool -S per-queue counters, and ring size (-G) and queue count
+ *   (-L) changed on a live device
+ * o TX completion ring: sent skbs wait in a lock-free per-queue ring
+ *   and are freed in bulk from NAPI poll with napi_consume_skb()
+ * o tracepoints along the data path (events/snull, see snull_trace.h),
+ *   and a TX-to-RX latency histogram in /sys/kernel/debug/snull/latency
+ * o a packet generator and sink for benchmarking, in debugfs too: see
+ *   bench.sh
+ * o deferred transmit: xmit only posts the skb on the TX ring and rings
+ *   the doorbell; a TX NAPI instance per queue puts it on the wire
  * 
  */
 
@@ -34,12 +79,42 @@
 #include <linux/netdevice.h>   /* struct device, and other headers */
 #include <linux/etherdevice.h> /* eth_type_trans */
 #include <linux/ip.h>          /* struct iphdr */
+#include <linux/udp.h>         /* struct udphdr */
 #include <linux/tcp.h>         /* struct tcphdr */
+#include <linux/ipv6.h>
+#include <net/ip.h>            /* ip_send_check() */
+#include <net/tcp.h>           /* tcp_v4_check() */
+#include <net/ip6_checksum.h>  /* tcp_v6_check() */
 #include <linux/skbuff.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/ethtool.h>
+#include <linux/net_tstamp.h>  /* hardware timestamping */
+#include <linux/uaccess.h>     /* copy_{from,to}_user() */
+#include <linux/hrtimer.h>     /* interrupt moderation timer */
+#include <linux/delay.h>       /* msleep() */
+#include <linux/random.h>
+#include <linux/hash.h>
+#include <asm/unaligned.h>
+#include <linux/rtnetlink.h>
 #include <linux/icmp.h>        /* ICMP proto types */
+#include <linux/icmpv6.h>
+#include <net/ipv6.h>          /* ipv6_addr_is_multicast() */
+#include <net/page_pool/helpers.h> /* page_pool_create(), page_pool_dev_alloc_pages() */
+#include <linux/bpf.h>
+#include <linux/bpf_trace.h>   /* trace_xdp_exception() */
+#include <linux/filter.h>      /* bpf_prog_run_xdp() */
+#include <net/xdp.h>
+#include <net/xdp_sock_drv.h>  /* AF_XDP zero-copy */
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
 
 #include "snull.h"
 
+#define CREATE_TRACE_POINTS
+#include "snull_trace.h"
+
 #include <linux/in6.h>
 #include <asm/checksum.h>
 
@@ -62,704 +137,3283 @@ module_param(timeout, int, 0);
 static int use_napi = 0;
 module_param(use_napi, int, 0);
 
+/*
+ * Hand NAPI-received frames to GRO, which merges consecutive TCP
+ * segments before they go up the stack? 'ethtool -K snX gro off' turns
+ * it off per device, too. The regular-interrupt path has no GRO.
+ */
+static int use_gro = 1;
+module_param(use_gro, int, 0);
+
+/*
+ * Poll in a kthread per NAPI instance instead of in softirq context?
+ * Same as writing 1 to /sys/class/net/snX/threaded, which can also
+ * turn it on and off later. Without use_napi, only the TX engines
+ * have NAPI instances to move.
+ */
+static int napi_threaded = 0;
+module_param(napi_threaded, int, 0);
+
+/*
+ * Number of devices. By default they are wired up in pairs, sn0 to sn1,
+ * sn2 to sn3, and so on; with l2_switch=1 they are all ports of one
+ * learning switch instead.
+ */
+static int num_devs = 2;
+module_param(num_devs, int, 0);
+
+static int l2_switch = 0;
+module_param(l2_switch, int, 0);
+
+/*
+ * Answer pings in "hardware": an ICMP or ICMPv6 echo request sent by a
+ * device comes back to it as the reply from its destination, so any
+ * address routed through snX can be pinged at full rate. Only in pair
+ * mode; switch ports are hosts that answer for themselves.
+ */
+static int echo_reflect = 1;
+module_param(echo_reflect, int, 0);
+
+/*
+ * Number of TX/RX queue pairs per device. Each pair gets its own
+ * packet pool, receive list, lock and (simulated) interrupt vector.
+ * The receiver's RSS decides which RX queue a frame lands on. Devices
+ * have a pair per CPU (or num_queues, if more), so that ethtool -L
+ * can turn on more of them later.
+ */
+static int num_queues = 1;
+module_param(num_queues, int, 0);
+
+static int max_queues;
+
+/*
+ * Largest MTU the devices accept. Receive buffers are sized for it at
+ * load time, so anything above 1500 costs higher-order pages.
+ */
+static int max_mtu = ETH_DATA_LEN;
+module_param(max_mtu, int, 0);
+
+/*
+ * Time every skb from ndo_start_xmit to the moment its frame goes up
+ * the receiver's stack, into the latency histogram in debugfs? Costs
+ * two clock reads a frame, so it is off by default; it can be turned
+ * on and off at any time in /sys/module/snull/parameters/.
+ */
+static int lat_hist = 0;
+module_param(lat_hist, int, 0644);
+
 
 /*
- * A structure representing an in-flight packet.
+ * A structure representing an in-flight packet. The frame itself lives
+ * in a page taken from the receiving queue's page pool: the sender
+ * writes it there (our "DMA"), and the receiver builds its skb around
+ * that very page.
  */
 struct snull_packet {
 	struct snull_packet *next;
-	struct net_device *dev;
+	struct snull_queue *queue;	/* the TX queue owning this buffer */
 	int	datalen;
-	u8 data[ETH_DATA_LEN];
+	struct page *page;		/* frame starts at SNULL_RX_HEADROOM */
+	struct xdp_buff *xsk;		/* ... or in an AF_XDP buffer instead */
+	u32 rss_hash;			/* what the receiver's RSS worked out */
+	enum pkt_hash_types rss_type;
+	ktime_t tstamp;			/* when it arrived, if the receiver asked */
+	u64 sent_ns;			/* for the latency histogram; 0: untimed */
 };
 
-static int pool_size = 8;
-module_param(pool_size, int, 0);
+/*
+ * A frame as the "hardware" fetches it at transmit time: a gather list
+ * of a linear piece and a range of an skb (which may span its frags),
+ * and the checksum to fill in, if any (CHECKSUM_PARTIAL: the sum from
+ * csum_start to the end goes at csum_start + csum_offset). The wire
+ * copies it into a receive buffer in one go.
+ */
+struct snull_frame {
+	void *head;			/* headers; the driver may rewrite them */
+	unsigned int head_len;
+	const struct sk_buff *skb;	/* then skb bytes [off, off + len) */
+	unsigned int off;
+	unsigned int len;
+	u16 csum_start;			/* 0: no checksum to fill in */
+	u16 csum_offset;
+	bool echo;			/* an echo request to turn into the reply */
+	const u8 *dest_addr;		/* if set, goes in h_dest on the wire */
+	u64 sent_ns;			/* when the stack sent it, if timed */
+};
 
 /*
- * This structure is private to each device. It is used to pass
- * packets in and out, so there is place for a packet
+ * What we keep in skb->cb from ndo_start_xmit until the TX engine.
+ * Written only once snull_tx() has the skb for good: until then the
+ * cb is the qdisc's, which a NETDEV_TX_BUSY return hands it back to.
  */
-struct snull_priv {
-	struct net_device_stats stats;
+struct snull_skb_cb {
+	u64 sent_ns;
+};
+#define SNULL_SKB_CB(skb) ((struct snull_skb_cb *)(skb)->cb)
+
+static inline void snull_frame_init(struct snull_frame *f, void *data,
+		unsigned int len)
+{
+	memset(f, 0, sizeof(*f));
+	f->head = data;
+	f->head_len = len;
+}
+
+static inline unsigned int snull_frame_len(const struct snull_frame *f)
+{
+	return f->head_len + f->len;
+}
+
+/*
+ * The echo reflector's rewrite, done on the wire's copy of an echo
+ * request that snull_echo_request() vetted: swap the addresses and make
+ * it a reply. The swap leaves the IPv4 header checksum and the ICMPv6
+ * pseudo-header sum as they are, so only the new type changes the ICMP
+ * checksum, which is patched incrementally (RFC 1624, eqn. 3).
+ */
+static void snull_echo_reply(void *frame)
+{
+	struct ethhdr *eth = frame;
+	struct iphdr *iph = frame + ETH_HLEN;
+	struct ipv6hdr *ip6h = frame + ETH_HLEN;
+	struct icmphdr *icmph;
+	struct icmp6hdr *icmp6h;
+	u8 mac[ETH_ALEN];
+
+	ether_addr_copy(mac, eth->h_dest);
+	ether_addr_copy(eth->h_dest, eth->h_source);
+	ether_addr_copy(eth->h_source, mac);
+	if (eth->h_proto == htons(ETH_P_IP)) {
+		swap(iph->saddr, iph->daddr);
+		icmph = frame + ETH_HLEN + iph->ihl * 4;
+		icmph->type = ICMP_ECHOREPLY;
+		csum_replace2(&icmph->checksum, htons(ICMP_ECHO << 8),
+			      htons(ICMP_ECHOREPLY << 8));
+	} else {
+		swap(ip6h->saddr, ip6h->daddr);
+		icmp6h = (struct icmp6hdr *)(ip6h + 1);
+		icmp6h->icmp6_type = ICMPV6_ECHO_REPLY;
+		csum_replace2(&icmp6h->icmp6_cksum, htons(ICMPV6_ECHO_REQUEST << 8),
+			      htons(ICMPV6_ECHO_REPLY << 8));
+	}
+}
+
+/* Gather a frame into 'to', inserting its checksum on the way */
+static void snull_frame_copy(const struct snull_frame *f, void *to)
+{
+	unsigned int len = snull_frame_len(f);
+	__wsum csum;
+
+	memcpy(to, f->head, f->head_len);
+	if (f->len)
+		skb_copy_bits(f->skb, f->off, to + f->head_len, f->len);
+	if (f->csum_start) {
+		csum = csum_partial(to + f->csum_start, len - f->csum_start, 0);
+		*(__sum16 *)(to + f->csum_start + f->csum_offset) =
+			csum_fold(csum) ?: CSUM_MANGLED_0;
+	}
+	if (f->dest_addr)
+		ether_addr_copy(((struct ethhdr *)to)->h_dest, f->dest_addr);
+	if (f->echo)
+		snull_echo_reply(to);
+}
+
+/*
+ * Layout of a receive page: headroom for XDP and the stack, the frame,
+ * then the skb_shared_info that build_skb() places at the end. The
+ * page order is picked at load time to fit a max_mtu frame; XDP only
+ * runs on frames that would fit a single page.
+ */
+#define SNULL_RX_HEADROOM	(XDP_PACKET_HEADROOM + NET_IP_ALIGN)
+#define SNULL_RX_SHINFO		SKB_DATA_ALIGN(sizeof(struct skb_shared_info))
+#define SNULL_RX_TRUESIZE	(PAGE_SIZE << snull_rx_order)
+#define SNULL_RX_MAX_FRAME	(SNULL_RX_TRUESIZE - SNULL_RX_HEADROOM - SNULL_RX_SHINFO)
+#define SNULL_XDP_MAX_MTU	(PAGE_SIZE - SNULL_RX_HEADROOM - ETH_HLEN - SNULL_RX_SHINFO)
+
+static unsigned int snull_rx_order;
+
+/*
+ * Number of buffer descriptors per queue; rounded up to a power of two.
+ * One is needed per frame on the wire, so this also caps the segments
+ * of a TSO skb, at half the ring: the TX engine waits until an skb's
+ * segments all have a descriptor, and a TSO skb that wanted the whole
+ * ring would wait for every frame in flight to be received, and hold
+ * up everything queued behind it meanwhile. The default of 128 lets a
+ * 64 KB TSO skb through whole (45 segments at an MSS of 1448); the
+ * book's 8 would cap it at 4.
+ */
+static int pool_size = 128;
+module_param(pool_size, int, 0);	/* per device later: ethtool -G */
+
+/*
+ * The packet pool of a queue, laid out like a NIC descriptor ring:
+ * a power-of-two array of free descriptors with free-running head and
+ * tail indices. The transmit side consumes at the head and the
+ * receive side gives buffers back at the tail. The two indices sit on
+ * separate cache lines, so the producer and consumer never bounce a
+ * line between them.
+ *
+ * The transmit side (the TX engine, and XDP) is the only consumer,
+ * serialized by the TX queue lock, so taking a buffer is lock-free.
+ * Buffers can be returned from more than one context (both devices'
+ * interrupt handlers, NAPI poll), which 'prod_lock' serializes on the
+ * tail side.
+ *
+ * Next to it is the TX ring proper, of the same size, which holds the
+ * skbs from ndo_start_xmit until their TX-done. It has four free-running
+ * indices, one per stage an skb goes through: xmit posts it at
+ * 'tx_prod' and the doorbell moves 'tx_tail' up to that; the TX engine
+ * (snull_tx_poll()) sends it and moves 'tx_fetched' past it; and the
+ * TX-done side (NAPI poll, or the interrupt handler under the queue
+ * lock without NAPI) frees it at 'tx_done'. Each index has one writer,
+ * and no side takes another's lock for the ring.
+ */
+struct snull_ring {
+	unsigned int tx_prod ____cacheline_aligned_in_smp;
+	unsigned int tx_tail;		/* rung for: the engine may fetch up to here */
+	bool starved;			/* queue stopped, the TX ring full */
+	unsigned int head ____cacheline_aligned_in_smp;
+	unsigned int tx_fetched;	/* sent by the engine */
+	bool stalled;			/* engine waiting for descriptors */
+	unsigned int tail ____cacheline_aligned_in_smp;
+	spinlock_t prod_lock;
+	unsigned int tx_done ____cacheline_aligned_in_smp;
+	unsigned int size;
+	unsigned int mask;
+	unsigned int wake_thresh;	/* restart the TX queue at this many free */
+	struct snull_packet **slots;
+	struct snull_packet *descs;
+	struct sk_buff **tx_skbs;
+};
+
+/*
+ * Device statistics, kept per CPU so that queues running on different
+ * CPUs never write to the same cache line; ndo_get_stats64 adds them
+ * up. The syncp lets 32-bit readers get consistent 64-bit values. All
+ * writers run with bottom halves disabled (xmit, NAPI, the simulated
+ * interrupts, the watchdog and moderation timers), so they never nest
+ * on one CPU.
+ */
+struct snull_pcpu_stats {
+	u64_stats_t rx_packets;
+	u64_stats_t rx_bytes;
+	u64_stats_t rx_dropped;
+	u64_stats_t tx_packets;
+	u64_stats_t tx_bytes;
+	u64_stats_t tx_dropped;
+	u64_stats_t tx_errors;
+	struct u64_stats_sync syncp;
+};
+
+#define snull_stats_inc(priv, field) do {				\
+	struct snull_pcpu_stats *__st = this_cpu_ptr((priv)->pcpu_stats); \
+	u64_stats_update_begin(&__st->syncp);				\
+	u64_stats_inc(&__st->field);					\
+	u64_stats_update_end(&__st->syncp);				\
+} while (0)
+
+#define snull_count_rx(priv, len) do {					\
+	struct snull_pcpu_stats *__st = this_cpu_ptr((priv)->pcpu_stats); \
+	u64_stats_update_begin(&__st->syncp);				\
+	u64_stats_inc(&__st->rx_packets);				\
+	u64_stats_add(&__st->rx_bytes, (len));				\
+	u64_stats_update_end(&__st->syncp);				\
+} while (0)
+
+#define snull_count_tx_segs(priv, segs, len) do {			\
+	struct snull_pcpu_stats *__st = this_cpu_ptr((priv)->pcpu_stats); \
+	u64_stats_update_begin(&__st->syncp);				\
+	u64_stats_add(&__st->tx_packets, (segs));			\
+	u64_stats_add(&__st->tx_bytes, (len));				\
+	u64_stats_update_end(&__st->syncp);				\
+} while (0)
+
+#define snull_count_tx(priv, len) snull_count_tx_segs(priv, 1, len)
+
+/*
+ * Interrupt moderation settings for one direction (ethtool -C); they
+ * are per device. Each queue moderates on its own, keeping a count of
+ * the events latched since its last interrupt and the delay in use,
+ * which adaptive mode moves between SNULL_COAL_ADAPT_{MIN,MAX}_USECS.
+ */
+struct snull_coal {
+	u32 usecs;
+	u32 max_frames;
+	bool adaptive;
+};
+
+struct snull_coal_state {
+	u32 usecs;
+	u32 pending;
+};
+
+/*
+ * Link emulation settings of a device, applied to everything it sends
+ * (/sys/class/net/snX/link/). Probabilities are in parts per million.
+ * The data path reads them without a lock.
+ */
+struct snull_link {
+	bool active;		/* any impairment set */
+	u32 rate_kbit;		/* token bucket rate; 0 for no limit */
+	u32 burst;		/* token bucket depth, bytes */
+	u32 delay_us;
+	u32 jitter_us;		/* the delay varies by this much either way */
+	u32 loss_ppm;		/* random loss (good state for Gilbert-Elliott) */
+	u32 ge_p_ppm;		/* Gilbert-Elliott good -> bad; 0: random loss */
+	u32 ge_r_ppm;		/* Gilbert-Elliott bad -> good */
+	u32 ge_bad_loss_ppm;	/* loss in the bad state */
+	u32 reorder_ppm;	/* sent at once, skipping delay and jitter */
+	u32 limit;		/* frames the wheel holds; beyond, overlimit */
+};
+
+/*
+ * The emulated wire of one TX queue: a timing wheel of SNULL_WIRE_SLOTS
+ * ticks, each slot a FIFO of the frames arriving during that tick, and
+ * an hrtimer set for the first non-empty slot. A frame on the wheel is
+ * a copy: its TX descriptor went home when it was made, so a long link
+ * carries as many frames as its 'limit' allows, not pool_size per
+ * delay. It takes a descriptor again when it arrives, to be received
+ * in. Allocated the first time the device's link settings are written.
+ */
+#define SNULL_WIRE_SLOTS	4096
+#define SNULL_WIRE_TICK_NS	(100 * NSEC_PER_USEC)
+
+struct snull_wire_frame {
+	struct snull_wire_frame *next;
+	struct snull_queue *dest;	/* the RX queue RSS picked */
+	struct snull_packet *pkt;	/* its descriptor, once it arrives */
+	u32 rss_hash;
+	enum pkt_hash_types rss_type;
+	u64 sent_ns;
+	unsigned int len;
+	u8 data[];
+};
+
+struct snull_wire {
+	struct snull_queue *q;	/* whose wire this is */
+	spinlock_t lock;
+	struct hrtimer timer;
+	bool armed;
+	u64 next_tick;		/* the timer's expiry, while armed */
+	u64 base;		/* last tick delivered */
+	unsigned int backlog;	/* frames on the wheel */
+	u64 tat;		/* token bucket: theoretical arrival time, ns */
+	bool ge_bad;		/* Gilbert-Elliott state */
+	u64 lost, overlimit;
+	struct {
+		struct snull_wire_frame *head, *tail;
+	} slot[SNULL_WIRE_SLOTS];
+};
+
+/*
+ * Per-queue event counters, for ethtool -S. Each one has a single
+ * writer at a time (the TX lock, the queue lock or NAPI), so plain
+ * increments do; readers may see them slightly stale.
+ */
+struct snull_queue_stats {
+	unsigned long pool_empty;	/* TX queue stopped, ring full */
+	unsigned long tx_stalls;	/* TX engine waited for descriptors */
+	unsigned long rx_drops;		/* frames with no receive buffer */
+	unsigned long interrupts;	/* handler runs */
+	unsigned long napi_polls;
+	unsigned long budget_exhausted;	/* polls that used up their budget */
+};
+
+/*
+ * One TX/RX queue pair. Like the queue pairs of a multi-queue NIC,
+ * each one has its own buffers, its own lock and its own interrupt
+ * vector, so traffic on different queues never shares a lock.
+ * The destination device's RSS picks the queue a packet is received
+ * on.
+ */
+struct snull_queue {
+	spinlock_t lock;
+	struct net_device *dev;
+	u16 index;
 	int status;
-	struct snull_packet *ppool;
-	struct snull_packet *rx_queue;  /* List of incoming packets */
+	struct snull_ring pool;
+	struct snull_packet *rx_queue;  /* FIFO of incoming packets */
+	struct snull_packet *rx_tail;
 	int rx_int_enabled;
-	int tx_packetlen;
-	u8 *tx_packetdata;
-	struct sk_buff *skb;
+	unsigned long tx_kicks;		/* doorbells rung */
+	unsigned long tx_batches;	/* engine runs; for the lockup simulation */
+	struct snull_queue_stats stats;	/* for ethtool -S */
+	struct napi_struct tx_napi;	/* the TX engine */
+	struct hrtimer coal_timer;	/* raises moderated interrupts */
+	bool coal_armed;
+	struct snull_coal_state rx_coal, tx_coal;
+	struct napi_struct napi;
+	struct page_pool *page_pool;	/* RX buffers; allocs under 'lock' */
+	struct xsk_buff_pool *xsk_pool;	/* AF_XDP zero-copy socket, if bound */
+	struct xdp_rxq_info xdp_rxq;
+	struct snull_wire *wire;	/* link emulation; NULL until configured */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * This structure is private to each device. The data path lives in
+ * the queues[] array; the device-wide lock only covers configuration.
+ */
+struct snull_priv {
+	struct snull_pcpu_stats __percpu *pcpu_stats;
 	spinlock_t lock;
-	struct napi_struct *pstNapi;
+	struct bpf_prog __rcu *xdp_prog;
+	struct snull_coal rx_coal, tx_coal;
+	struct snull_link link;
+	u8 rss_key[SNULL_RSS_KEY_SIZE];
+	u32 rss_indir[SNULL_RSS_INDIR_SIZE];
+	struct hwtstamp_config hwts;	/* SIOCSHWTSTAMP; written under 'lock' */
+	int index;			/* in snull_devs[], i.e. the switch port */
+	bool down;			/* closed or reconfiguring: the wire drops */
+	int num_queues;			/* in use (ethtool -L) ... */
+	int max_queues;			/* ... out of this many */
+	struct snull_queue queues[];
 };
 
-static void snull_tx_timeout(struct net_device *dev);
+static void snull_tx_timeout(struct net_device *dev, unsigned int txqueue);
 static void (*snull_interrupt)(int, void *);
 
 /*
- * Set up a device's packet pool.
+ * The "bus" our devices sit on. AF_XDP zero-copy wants the umem mapped
+ * for DMA by the driver, which needs a struct device to map against.
+ */
+static struct platform_device *snull_pdev;
+
+/*
+ * The latency histogram (lat_hist=1): log2 buckets of nanoseconds from
+ * transmit to receive delivery, bucket n counting [2^(n-1), 2^n). Kept
+ * per CPU like the device statistics, and summed up when read.
  */
-static void snull_setup_pool(struct net_device *dev)
+struct snull_lat_hist {
+	u64 count[SNULL_LAT_BUCKETS];
+};
+static DEFINE_PER_CPU(struct snull_lat_hist, snull_lat);
+static struct dentry *snull_debugfs;
+
+static inline u64 snull_lat_stamp(void)
 {
-	struct snull_priv *priv = netdev_priv(dev);
-	struct snull_packet *pkt;
-	int i;
+	return READ_ONCE(lat_hist) ? ktime_get_ns() : 0;
+}
 
-	assert (priv != NULL);
+static inline void snull_lat_record(u64 sent_ns)
+{
+	if (sent_ns)
+		this_cpu_inc(snull_lat.count[min_t(unsigned int,
+			fls64(ktime_get_ns() - sent_ns), SNULL_LAT_BUCKETS - 1)]);
+}
+
+/*
+ * The benchmark (debugfs snull/bench): an in-module generator, run by
+ * writing to the file, sends UDP frames to port SNULL_BENCH_PORT from
+ * one device, and a sink on the receiving device counts and frees them
+ * instead of passing them up the stack. The rest of the settings and
+ * the report of the last run are in debugfs as well.
+ */
+static struct snull_bench {
+	u32 dev;		/* index of the sending device; the sink is dev ^ 1 */
+	u32 size;		/* frame length, Ethernet header included */
+	u32 burst;		/* frames per doorbell (xmit_more) */
+	u32 count;		/* frames per run */
+	u32 flows;		/* UDP source ports, for RSS */
+	struct net_device *sink;	/* set while a run is on */
+	/* The last run */
+	u64 sent, received, time_ns;
+	u64 p50_ns, p99_ns, p999_ns;
+} snull_bench = {
+	.size = ETH_ZLEN,
+	.burst = 32,
+	.count = 1000000,
+	.flows = 1,
+};
+
+struct snull_bench_sink {
+	u64 packets;
+	u64 bytes;
+};
+static DEFINE_PER_CPU(struct snull_bench_sink, snull_bench_rx);
 
-	// The debug print below shows the 2 net devices & their private pointers
-	MSG("netdev = %08lx priv=%08lx\n", dev, priv);
+/*
+ * The sink: is this received skb a benchmark frame? If so it is
+ * counted and freed. Costs one test of a cached pointer otherwise.
+ */
+static bool snull_bench_sink(struct sk_buff *skb)
+{
+	struct iphdr _iph;
+	struct udphdr _uh;
+	const struct iphdr *iph;
+	const struct udphdr *uh;
+
+	if (likely(READ_ONCE(snull_bench.sink) != skb->dev))
+		return false;
+	if (skb->protocol != htons(ETH_P_IP))
+		return false;
+	iph = skb_header_pointer(skb, 0, sizeof(_iph), &_iph);
+	if (!iph || iph->ihl != 5 || iph->protocol != IPPROTO_UDP)
+		return false;
+	uh = skb_header_pointer(skb, sizeof(*iph), sizeof(_uh), &_uh);
+	if (!uh || uh->dest != htons(SNULL_BENCH_PORT))
+		return false;
+	this_cpu_inc(snull_bench_rx.packets);
+	this_cpu_add(snull_bench_rx.bytes, skb->len + ETH_HLEN);
+	consume_skb(skb);
+	return true;
+}
 
-	priv->ppool = NULL;
-	for (i = 0; i < pool_size; i++) {
-		pkt = kmalloc (sizeof (struct snull_packet), GFP_KERNEL);
-		if (NULL == pkt) {
-			printk (KERN_NOTICE "%s: Ran out of memory allocating packet pool\n", DRVNAME);
-			return;
+/*
+ * Receive-side scaling, as the receiving device's "hardware" does it:
+ * the Toeplitz hash of the IP addresses, plus the ports for TCP and UDP
+ * (unless fragmented), indexes the indirection table, whose entry is the
+ * RX queue. Other frames hash to 0. Key and table are read without a
+ * lock; a frame racing with ethtool -X may be steered by a mix of old
+ * and new settings, which does no harm.
+ */
+static u32 snull_toeplitz(const u8 *key, const u8 *data, unsigned int len)
+{
+	u32 hash = 0, v = get_unaligned_be32(key);
+	unsigned int i;
+	int bit;
+
+	/* 'v' is the 32 key bits starting at the current input bit */
+	for (i = 0; i < len; i++) {
+		for (bit = 7; bit >= 0; bit--) {
+			if (data[i] & BIT(bit))
+				hash ^= v;
+			v = (v << 1) | ((key[i + 4] >> bit) & 1);
 		}
-		pkt->dev = dev;
-		pkt->next = priv->ppool;
-		priv->ppool = pkt;
-#if 0   // enable to see the linked list of buffer pool
-		MSG("pkt=%08lx pkt->next=%08lx priv->ppool=%08lx\n",
-			pkt, pkt->next, priv->ppool);
-#endif
 	}
+	return hash;
+}
+
+/*
+ * Get 'len' bytes at 'off' into the frame: in place if they are in the
+ * linear piece, copied to 'buf' otherwise. NULL if the frame is shorter.
+ */
+static const void *snull_frame_header(const struct snull_frame *f,
+		unsigned int off, unsigned int len, void *buf)
+{
+	unsigned int copy;
+
+	if (off + len > snull_frame_len(f))
+		return NULL;
+	if (off + len <= f->head_len)
+		return f->head + off;
+	copy = off < f->head_len ? f->head_len - off : 0;
+	memcpy(buf, f->head + off, copy);
+	if (skb_copy_bits(f->skb, f->off + off + copy - f->head_len,
+			  buf + copy, len - copy))
+		return NULL;
+	return buf;
 }
 
-static void snull_teardown_pool(struct net_device *dev)
+static struct snull_queue *snull_rss_steer(struct net_device *dev,
+		const struct snull_frame *f, struct snull_packet *pkt)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	struct snull_packet *pkt;
-    
-	while ((pkt = priv->ppool)) {
-		priv->ppool = pkt->next;
-		kfree (pkt);
-		/* FIXME - in-flight packets ? */
+	const struct ethhdr *eth = f->head;	/* always in the linear piece */
+	u8 tuple[2 * sizeof(struct in6_addr) + 4];
+	union {
+		struct iphdr v4;
+		struct ipv6hdr v6;
+	} buf;
+	const struct iphdr *iph;
+	const struct ipv6hdr *ip6h;
+	const void *ports;
+	unsigned int len, thoff;
+	u8 proto;
+
+	pkt->rss_hash = 0;
+	pkt->rss_type = PKT_HASH_TYPE_NONE;
+	switch (eth->h_proto) {
+	case htons(ETH_P_IP):
+		iph = snull_frame_header(f, ETH_HLEN, sizeof(*iph), &buf);
+		if (!iph || iph->ihl < 5)
+			goto out;
+		memcpy(tuple, &iph->saddr, 2 * sizeof(iph->saddr));
+		len = 2 * sizeof(iph->saddr);
+		proto = ip_is_fragment(iph) ? 0 : iph->protocol;
+		thoff = ETH_HLEN + iph->ihl * 4;
+		break;
+	case htons(ETH_P_IPV6):
+		ip6h = snull_frame_header(f, ETH_HLEN, sizeof(*ip6h), &buf);
+		if (!ip6h)
+			goto out;
+		memcpy(tuple, &ip6h->saddr, 2 * sizeof(ip6h->saddr));
+		len = 2 * sizeof(ip6h->saddr);
+		proto = ip6h->nexthdr;	/* extension headers: addresses only */
+		thoff = ETH_HLEN + sizeof(*ip6h);
+		break;
+	default:
+		goto out;
+	}
+	pkt->rss_type = PKT_HASH_TYPE_L3;
+	if (proto == IPPROTO_TCP || proto == IPPROTO_UDP) {
+		ports = snull_frame_header(f, thoff, 4, &buf);
+		if (ports) {
+			memcpy(tuple + len, ports, 4);
+			len += 4;
+			pkt->rss_type = PKT_HASH_TYPE_L4;
+		}
 	}
-}    
+	pkt->rss_hash = snull_toeplitz(priv->rss_key, tuple, len);
+  out:
+	return &priv->queues[READ_ONCE(priv->rss_indir[pkt->rss_hash &
+						       (SNULL_RSS_INDIR_SIZE - 1)])];
+}
 
 /*
- * Buffer/pool management.
+ * Is the frame an echo request the reflector should answer: ICMP echo
+ * (unfragmented, IP options allowed) or ICMPv6 echo right behind the
+ * IPv6 header, to a unicast address?
  */
-static struct snull_packet *snull_get_tx_buffer(struct net_device *dev)
+static bool snull_echo_request(const struct snull_frame *f)
 {
-	struct snull_priv *priv = netdev_priv(dev);
-	unsigned long flags;
-	struct snull_packet *pkt;
-    
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->ppool;
-	priv->ppool = pkt->next;
-	if (priv->ppool == NULL) {
-		printk (KERN_INFO "%s: Pool empty\n", DRVNAME);
-		netif_stop_queue(dev);
+	const struct ethhdr *eth = f->head;	/* always in the linear piece */
+	union {
+		struct iphdr v4;
+		struct ipv6hdr v6;
+	} buf;
+	const struct iphdr *iph;
+	const struct ipv6hdr *ip6h;
+	const u8 *icmp;			/* type, code and checksum */
+
+	switch (eth->h_proto) {
+	case htons(ETH_P_IP):
+		iph = snull_frame_header(f, ETH_HLEN, sizeof(*iph), &buf);
+		if (!iph || iph->version != 4 || iph->ihl < 5 ||
+		    iph->protocol != IPPROTO_ICMP || ip_is_fragment(iph) ||
+		    ipv4_is_multicast(iph->daddr) || ipv4_is_lbcast(iph->daddr))
+			return false;
+		icmp = snull_frame_header(f, ETH_HLEN + iph->ihl * 4, 4, &buf);
+		return icmp && icmp[0] == ICMP_ECHO && icmp[1] == 0;
+	case htons(ETH_P_IPV6):
+		ip6h = snull_frame_header(f, ETH_HLEN, sizeof(*ip6h), &buf);
+		if (!ip6h || ip6h->version != 6 ||
+		    ip6h->nexthdr != IPPROTO_ICMPV6 ||
+		    ipv6_addr_is_multicast(&ip6h->daddr))
+			return false;
+		icmp = snull_frame_header(f, ETH_HLEN + sizeof(*ip6h), 4, &buf);
+		return icmp && icmp[0] == ICMPV6_ECHO_REQUEST && icmp[1] == 0;
 	}
-	spin_unlock_irqrestore(&priv->lock, flags);
-	return pkt;
+	return false;
 }
 
-
-static void snull_release_buffer(struct snull_packet *pkt)
+/* Hand the RSS hash to the stack, unless rxhash is turned off */
+static inline void snull_rx_hash(struct net_device *dev, struct sk_buff *skb,
+		const struct snull_packet *pkt)
 {
-	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(pkt->dev);
-	
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->ppool;
-	priv->ppool = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
-	if (netif_queue_stopped(pkt->dev) && pkt->next == NULL)
-		netif_wake_queue(pkt->dev);
+	if ((dev->features & NETIF_F_RXHASH) && pkt->rss_type != PKT_HASH_TYPE_NONE)
+		skb_set_hash(skb, pkt->rss_hash, pkt->rss_type);
 }
 
-static void snull_enqueue_buf(struct net_device *dev, struct snull_packet *pkt)
+/* ... and the RX timestamp taken at the wire, if asked for */
+static inline void snull_rx_tstamp(struct net_device *dev, struct sk_buff *skb,
+		const struct snull_packet *pkt)
 {
-	unsigned long flags;
 	struct snull_priv *priv = netdev_priv(dev);
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt->next = priv->rx_queue;  /* FIXME - misorders packets */
-	priv->rx_queue = pkt;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	if (READ_ONCE(priv->hwts.rx_filter) != HWTSTAMP_FILTER_NONE)
+		skb_hwtstamps(skb)->hwtstamp = pkt->tstamp;
 }
 
-static struct snull_packet *snull_dequeue_buf(struct net_device *dev)
+/* In pair mode, the device at the other end of the cable */
+static inline struct net_device *snull_peer(struct net_device *dev)
 {
 	struct snull_priv *priv = netdev_priv(dev);
-	struct snull_packet *pkt;
-	unsigned long flags;
 
-	spin_lock_irqsave(&priv->lock, flags);
-	pkt = priv->rx_queue;
-	if (pkt != NULL)
-		priv->rx_queue = pkt->next;
-	spin_unlock_irqrestore(&priv->lock, flags);
-	return pkt;
+	return snull_devs[priv->index ^ 1];
 }
 
 /*
- * Enable and disable receive interrupts.
+ * The switch's forwarding database, learnt from source addresses: a
+ * direct-mapped table from MAC address to port. An entry packs the
+ * address and port + 1 into one atomic64_t, so the data path of every
+ * port reads and updates it without a lock. A collision just evicts
+ * the older address, whose frames are flooded until it is seen again.
  */
-static void snull_rx_ints(struct net_device *dev, int enable)
-{
-	struct snull_priv *priv = netdev_priv(dev);
-	priv->rx_int_enabled = enable;
-}
+#define SNULL_FDB_BITS		10
+#define SNULL_FDB_AGEING	(300 * HZ)
 
-    
-/*
- * Open and close
- */
+static struct snull_fdb_entry {
+	atomic64_t addr_port;
+	unsigned long updated;
+} snull_fdb[1 << SNULL_FDB_BITS];
 
-static int snull_open(struct net_device *dev)
+static void snull_fdb_learn(const u8 *addr, int port)
 {
-	/* request_region(), request_irq(), ....  (like fops->open) */
+	u64 key = ether_addr_to_u64(addr);
+	u64 val = key << 16 | (port + 1);
+	struct snull_fdb_entry *e = &snull_fdb[hash_64(key, SNULL_FDB_BITS)];
 
-	/* 
-	 * Assign the hardware address of the board: use "\0SNULx", where
-	 * x is 0 or 1. The first byte is '\0' to avoid being a multicast
-	 * address (the first byte of multicast addrs is odd).
-	 */
-	memcpy(dev->dev_addr, "\0SNUL0", ETH_ALEN);
-	if (dev == snull_devs[1])
-		dev->dev_addr[ETH_ALEN-1]++; /* \0SNUL1 */
-	netif_start_queue(dev);
-	return 0;
+	if (!is_valid_ether_addr(addr))
+		return;
+	/* Don't dirty a cache line shared by all ports for nothing */
+	if (atomic64_read(&e->addr_port) != val)
+		atomic64_set(&e->addr_port, val);
+	if (READ_ONCE(e->updated) != jiffies)
+		WRITE_ONCE(e->updated, jiffies);
 }
 
-static int snull_release(struct net_device *dev)
+/* The port 'addr' was learnt on, or -1 if the frame must be flooded */
+static int snull_fdb_lookup(const u8 *addr)
 {
-    /* release ports, irq and such -- like fops->close */
+	u64 key = ether_addr_to_u64(addr);
+	struct snull_fdb_entry *e = &snull_fdb[hash_64(key, SNULL_FDB_BITS)];
+	u64 val;
+
+	if (!is_unicast_ether_addr(addr))
+		return -1;
+	val = atomic64_read(&e->addr_port);
+	if (val >> 16 != key ||
+	    time_after(jiffies, READ_ONCE(e->updated) + SNULL_FDB_AGEING))
+		return -1;
+	return (val & 0xffff) - 1;
+}
 
-	netif_stop_queue(dev); /* can't transmit any more */
-	return 0;
+static void snull_teardown_pool(struct snull_queue *q)
+{
+	struct snull_ring *ring = &q->pool;
+
+	/* The descriptors are one array, in-flight ones included */
+	kfree(ring->slots);
+	kfree(ring->descs);
+	kfree(ring->tx_skbs);
+	ring->slots = NULL;
+	ring->descs = NULL;
+	ring->tx_skbs = NULL;
 }
 
 /*
- * Configuration changes (passed on by ifconfig)
+ * Set up a queue's packet pool of 'size' (a power of two) descriptors:
+ * all are allocated at once and start out free, so the ring is full.
+ * The TX ring starts out empty. An existing pool, all of whose
+ * descriptors must be home and skbs completed, is replaced only once
+ * the new one is allocated.
  */
-static int snull_config(struct net_device *dev, struct ifmap *map)
+static int snull_setup_pool(struct snull_queue *q, unsigned int size)
 {
-	if (dev->flags & IFF_UP) /* can't act on a running interface */
-		return -EBUSY;
-
-	/* Don't allow changing the I/O address */
-	if (map->base_addr != dev->base_addr) {
-		printk(KERN_WARNING "%s: Can't change I/O address\n", DRVNAME);
-		return -EOPNOTSUPP;
+	struct snull_ring *ring = &q->pool;
+	struct snull_packet **slots;
+	struct snull_packet *descs;
+	struct sk_buff **tx_skbs;
+	unsigned int i;
+
+	assert (q != NULL);
+
+	// The debug print below shows the net devices & their queues
+	MSG("netdev = %08lx queue %d = %08lx\n", q->dev, q->index, q);
+
+	descs = kcalloc(size, sizeof(struct snull_packet), GFP_KERNEL);
+	slots = kcalloc(size, sizeof(struct snull_packet *), GFP_KERNEL);
+	tx_skbs = kcalloc(size, sizeof(struct sk_buff *), GFP_KERNEL);
+	if (!descs || !slots || !tx_skbs) {
+		printk (KERN_NOTICE "%s: Ran out of memory allocating packet pool\n", DRVNAME);
+		kfree(descs);
+		kfree(slots);
+		kfree(tx_skbs);
+		return -ENOMEM;
 	}
-
-	/* Allow changing the IRQ */
-	if (map->irq != dev->irq) {
-		dev->irq = map->irq;
-        	/* request_irq() is delayed to open-time */
+	snull_teardown_pool(q);
+	spin_lock_init(&ring->prod_lock);
+	ring->head = ring->tail = 0;
+	ring->tx_prod = ring->tx_tail = ring->tx_fetched = ring->tx_done = 0;
+	ring->starved = false;
+	ring->stalled = false;
+	ring->descs = descs;
+	ring->slots = slots;
+	ring->tx_skbs = tx_skbs;
+	ring->size = size;
+	ring->mask = size - 1;
+	ring->wake_thresh = max(size / 4, 1U);
+	for (i = 0; i < size; i++) {
+		ring->descs[i].queue = q;
+		ring->slots[i] = &ring->descs[i];
 	}
-
-	/* ignore other fields */
+	ring->tail = size;
 	return 0;
 }
 
+static void snull_teardown_page_pool(struct snull_queue *q)
+{
+	if (q->page_pool)
+		page_pool_destroy(q->page_pool);
+	q->page_pool = NULL;
+}
+
 /*
- * Receive a packet: retrieve, encapsulate and pass over to upper levels.
- * Called with the spinlock held.
+ * Each queue receives into pages from its own page pool, sized like
+ * its ring. The pool lives until the device goes or the ring is
+ * resized; pages come back to it when the skbs built around them are
+ * freed, even after page_pool_destroy().
  */
-static void snull_rx(struct net_device *dev, struct snull_packet *pkt)
+static int snull_setup_page_pool(struct snull_queue *q)
 {
-	struct sk_buff *skb;
-	struct snull_priv *priv = netdev_priv(dev);
-	struct icmphdr *ich = NULL;
-
-QP;
-	/*
-	 * The packet has been retrieved from the transmission
-	 * medium. Build an skb around it, so upper layers can handle it
-	 */
-	skb = dev_alloc_skb(pkt->datalen + 2);
-	if (!skb) {
-		if (printk_ratelimit())
-			printk(KERN_NOTICE "%s rx: low on mem - packet dropped\n", DRVNAME);
-		priv->stats.rx_dropped++;
-		goto out;
+	struct page_pool_params pp = {
+		.order		= snull_rx_order,
+		.pool_size	= q->pool.size,
+		.nid		= NUMA_NO_NODE,
+	};
+	struct page_pool *page_pool;
+
+	page_pool = page_pool_create(&pp);
+	if (IS_ERR(page_pool)) {
+		printk (KERN_NOTICE "%s: Can't create page pool for queue %d\n", DRVNAME, q->index);
+		return PTR_ERR(page_pool);
 	}
-	skb_reserve(skb, 2); /* align IP on 16B boundary */  
-	/* In order to insert the rx packet data at the end of the skb payload, 
-	   first make space in the SKB payload region, by increasing skb->tail 
-	   with the skb_put(); then, we copy in the packet data (a real NIC 
-	   driver would probably use DMA).
-	  */
-	memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
-
-	/* Write metadata, and then pass to the receive level */
-	skb->dev = dev;
-	skb->protocol = eth_type_trans(skb, dev);
-	skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-	priv->stats.rx_packets++;
-	priv->stats.rx_bytes += pkt->datalen;
-
-	/* By now, skb->data points to the beginning of the IP header
-	   (the ETH header is "stripped off"). */
-#if 0
-	print_hex_dump_bytes ("", DUMP_PREFIX_OFFSET, skb->data, skb->len);
-#endif
-
-	ich = (struct icmphdr *)(skb->data+sizeof(struct iphdr));
-
-	// Is this really an ICMP packet?
-	// The byte following ICMP protocol Type is Code which should be 0
-	if (((ich->type == ICMP_ECHO) || (ich->type == ICMP_ECHOREPLY)) && (ich->code == 0x0)) { // ICMP ping
-		if (ich->type == ICMP_ECHO)
-			MSG("Rx:[ping] ICMP ECHO request packet\n");
-		else if (ich->type == ICMP_ECHOREPLY)
-			MSG("Rx:[ping] ICMP ECHOREPLY reply packet\n");
+	snull_teardown_page_pool(q);
+	q->page_pool = page_pool;
+	return 0;
+}
 
-		print_hex_dump_bytes ("", DUMP_PREFIX_OFFSET, skb->data, skb->len);
-		/* Convert the ICMP_ECHO request packet to an ICMP_ECHOREPLY reply packet and
-		 * send it up the protocol stack. Will appear just as though the ping worked in
-		 * the usual way!
-		 */
-		if (ich->type == ICMP_ECHO) {
-			ich->type=ICMP_ECHOREPLY;
-			// FIXME- checksum reported as wrong by wireshark
-			//ich->checksum += 0x800;
-			skb->data[24] += 0x8; // checksum . ping Works!
-			//MSG("icmp type = x%x imcp cksum=x%04x id=%x\n", 
-			// ich->type, ntohs(ich->checksum), ntohs(ich->un.echo.id));
-			MSG ("Rx: converted to ICMP ECHOREPLY and being sent up!\n");
-		}
+/*
+ * Get a receive buffer on the destination queue and write the frame
+ * into it. The buffer comes from the AF_XDP pool when a zero-copy
+ * socket is bound to the queue, from the page pool otherwise. Neither
+ * allocator may be used concurrently and several senders can target
+ * one queue, so this is called with the queue's lock held.
+ */
+static bool snull_rx_fill(struct snull_queue *q, struct snull_packet *pkt,
+		const struct snull_frame *f)
+{
+	unsigned int len = snull_frame_len(f);
+
+	pkt->datalen = len;
+	pkt->page = NULL;
+	pkt->xsk = NULL;
+	if (q->xsk_pool) {
+		if (len > xsk_pool_get_rx_frame_size(q->xsk_pool))
+			return false;
+		pkt->xsk = xsk_buff_alloc(q->xsk_pool);
+		if (!pkt->xsk)
+			return false;
+		xsk_buff_set_size(pkt->xsk, len);
+		snull_frame_copy(f, pkt->xsk->data);
+		return true;
 	}
+	if (len > SNULL_RX_MAX_FRAME)	/* from a peer with a larger max_mtu */
+		return false;
+	pkt->page = page_pool_dev_alloc_pages(q->page_pool);
+	if (!pkt->page)
+		return false;
+	snull_frame_copy(f, page_address(pkt->page) + SNULL_RX_HEADROOM);
+	return true;
+}
 
-	if (netif_rx(skb) == NET_RX_DROP) {
-		printk (KERN_ALERT "%s:%s: ALERT! [Rx path] congestion:packet dropped!\n", DRVNAME, __func__);
-	}
-  out:
-	return;
+/*
+ * Give a receive buffer back to its pool. Called with the queue's
+ * lock held when it may be an AF_XDP buffer (see snull_rx_fill).
+ */
+static void snull_rx_free(struct snull_queue *q, struct snull_packet *pkt)
+{
+	if (pkt->xsk)
+		xsk_buff_free(pkt->xsk);
+	else
+		page_pool_put_full_page(q->page_pool, pkt->page, false);
 }
-    
 
 /*
- * The poll implementation.
+ * Wrap an skb around a received page. There is no copy: the frame was
+ * written there at transmit time. The skb is marked for recycling, so
+ * freeing it hands the page back to the pool. The frame normally
+ * starts at SNULL_RX_HEADROOM, but an XDP program may have moved it.
  */
-static int snull_poll(struct napi_struct *napi, int budget)
+static struct sk_buff *snull_build_skb(struct snull_queue *q, struct page *page,
+		unsigned int headroom, unsigned int len, bool in_napi)
 {
-	int npackets = 0, quota = budget;
+	void *va = page_address(page);
 	struct sk_buff *skb;
-	struct net_device *dev = napi->dev;
-	struct snull_priv *priv = netdev_priv(dev);
-	struct snull_packet *pkt;
-    
-QP;
-	while (npackets < quota && priv->rx_queue) {
-		pkt = snull_dequeue_buf(dev);
-		skb = dev_alloc_skb(pkt->datalen + 2);
-		if (! skb) {
-			if (printk_ratelimit())
-				printk(KERN_NOTICE "%s: packet dropped\n", DRVNAME);
-			priv->stats.rx_dropped++;
-			snull_release_buffer(pkt);
-			continue;
-		}
-		skb_reserve(skb, 2); /* align IP on 16B boundary */  
-	/* In order to insert the rx packet data at the end of the skb payload, 
-	   first make space in the SKB payload region, by increasing skb->tail 
-	   with the skb_put(); then, we copy in the packet data (a real NIC 
-	   driver would probably use DMA).
-	  */
-		memcpy(skb_put(skb, pkt->datalen), pkt->data, pkt->datalen);
-		skb->dev = dev;
-		skb->protocol = eth_type_trans(skb, dev);
-		skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
-		netif_receive_skb(skb);
-		
-        	/* Maintain stats */
-		npackets++;
-		priv->stats.rx_packets++;
-		priv->stats.rx_bytes += pkt->datalen;
-		snull_release_buffer(pkt);
-	}
 
-	/* If we processed all packets, we're done; tell the kernel and reenable ints */
-	quota -= npackets;
-	if (! priv->rx_queue) {
-		//netif_rx_complete(dev, priv->pstNapi);
-		napi_disable (priv->pstNapi);
-		snull_rx_ints(dev, 1);
-		return 0;
+	if (in_napi)
+		skb = napi_build_skb(va, SNULL_RX_TRUESIZE);
+	else
+		skb = build_skb(va, SNULL_RX_TRUESIZE);
+	if (unlikely(!skb)) {
+		page_pool_put_full_page(q->page_pool, page, false);
+		return NULL;
 	}
-	/* We couldn't process everything. */
-	return 1;
+	skb_mark_for_recycle(skb);
+	skb_reserve(skb, headroom);
+	skb_put(skb, len);
+	return skb;
 }
 
+/*
+ * Buffer/pool management.
+ */
+static inline unsigned int snull_pool_avail(struct snull_ring *ring)
+{
+	return READ_ONCE(ring->tail) - READ_ONCE(ring->head);
+}
 
 /*
- * The typical interrupt entry point
+ * Room to transmit: free slots on the TX ring. Descriptors are only
+ * taken when the engine fetches an skb, and the engine waits when it
+ * runs out, so a ring short of descriptors fills up and stops the
+ * queue all the same. Under the TX queue lock.
  */
-static void snull_regular_interrupt(int irq, void *dev_id)
+static inline unsigned int snull_tx_room(struct snull_ring *ring)
 {
-	int statusword;
-	struct snull_priv *priv;
-	struct snull_packet *pkt = NULL;
-	/*
-	 * As usual, check the "device" pointer to be sure it is
-	 * really interrupting.
-	 * Then assign "struct device *dev"
+	return ring->size - (ring->tx_prod - READ_ONCE(ring->tx_done));
+}
+
+/*
+ * Stop the TX queue if the TX ring is full; returns true if it stays
+ * stopped. The TX-done side restarts it once wake_thresh slots are
+ * free. The queue is restarted right away if room came back
+ * meanwhile, since the other side may have looked for a stopped queue
+ * just before we stopped it.
+ */
+static bool snull_maybe_stop_tx(struct snull_queue *q)
+{
+	struct snull_ring *ring = &q->pool;
+
+	if (likely(snull_tx_room(ring)))
+		return false;
+
+	PDEBUG("TX ring full on queue %d\n", q->index);
+	q->stats.pool_empty++;
+	WRITE_ONCE(ring->starved, true);
+	netif_stop_subqueue(q->dev, q->index);
+	smp_mb();
+	if (snull_tx_room(ring) < ring->wake_thresh)
+		return true;
+	WRITE_ONCE(ring->starved, false);
+	netif_start_subqueue(q->dev, q->index);
+	return false;
+}
+
+/*
+ * Take a free descriptor; under the TX queue lock.
+ */
+static struct snull_packet *snull_get_tx_buffer(struct snull_queue *q)
+{
+	struct snull_ring *ring = &q->pool;
+	struct snull_packet *pkt;
+	unsigned int head = ring->head;
+
+	/* Pairs with the release in snull_release_buffer() */
+	if (smp_load_acquire(&ring->tail) == head)
+		return NULL;
+	pkt = ring->slots[head & ring->mask];
+	smp_store_release(&ring->head, head + 1);
+	return pkt;
+}
+
+/*
+ * Restart the TX queue if we stopped it and there is room again.
+ * Pairs with the barrier after netif_stop_subqueue() above. Only undo
+ * our own stop: a simulated lockup must wait for the watchdog.
+ */
+static void snull_maybe_wake_tx(struct snull_queue *q)
+{
+	struct snull_ring *ring = &q->pool;
+
+	smp_mb();
+	if (READ_ONCE(ring->starved) &&
+	    ring->size - (READ_ONCE(ring->tx_prod) - ring->tx_done) >= ring->wake_thresh) {
+		WRITE_ONCE(ring->starved, false);
+		netif_wake_subqueue(q->dev, q->index);
+	}
+}
+
+/*
+ * Give a descriptor back, and restart the TX engine if it was waiting
+ * for one.
+ */
+static void snull_release_buffer(struct snull_packet *pkt)
+{
+	unsigned long flags;
+	struct snull_queue *q = pkt->queue;
+	struct snull_ring *ring = &q->pool;
+	unsigned int tail;
+	
+	spin_lock_irqsave(&ring->prod_lock, flags);
+	tail = ring->tail;
+	ring->slots[tail & ring->mask] = pkt;
+	smp_store_release(&ring->tail, tail + 1);
+	spin_unlock_irqrestore(&ring->prod_lock, flags);
+
+	/* Pairs with the barrier in snull_tx_poll() */
+	smp_mb();
+	if (unlikely(READ_ONCE(ring->stalled))) {
+		WRITE_ONCE(ring->stalled, false);
+		napi_schedule(&q->tx_napi);
+	}
+}
+
+/*
+ * Interrupt moderation. Like a NIC with coalescing turned on, we don't
+ * interrupt for every event (a received frame, a completed transmit):
+ * the event is latched in the status word, and the interrupt is raised
+ * once 'max_frames' events are pending or 'usecs' after the first one,
+ * whichever comes first. A queue has a single vector, so the timer is
+ * armed for the earlier of the RX and TX deadlines. With usecs at 0,
+ * the default, every event interrupts right away.
+ *
+ * Called with the lock held. Returns true if the interrupt is due now:
+ * the caller must then call snull_coal_fire().
+ */
+static bool __snull_coal_event(struct snull_queue *q, int what)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	const struct snull_coal *coal;
+	struct snull_coal_state *cs;
+	ktime_t delay;
+
+	if (what == SNULL_RX_INTR) {
+		coal = &priv->rx_coal;
+		cs = &q->rx_coal;
+	} else {
+		coal = &priv->tx_coal;
+		cs = &q->tx_coal;
+	}
+	q->status |= what;
+	cs->pending++;
+	if (!cs->usecs || (coal->max_frames && cs->pending >= coal->max_frames))
+		return true;
+
+	delay = us_to_ktime(cs->usecs);
+	if (!q->coal_armed ||
+	    ktime_before(ktime_add(ktime_get(), delay),
+			 hrtimer_get_expires(&q->coal_timer))) {
+		hrtimer_start(&q->coal_timer, delay, HRTIMER_MODE_REL_SOFT);
+		q->coal_armed = true;
+	}
+	return false;
+}
+
+/*
+ * Adaptive moderation: a timer that went off for a single event means
+ * a quiet link, so halve the delay for latency; a full batch means a
+ * busy one, so double it and take fewer interrupts. Lock held.
+ */
+static void snull_coal_adapt(struct snull_coal_state *cs, const struct snull_coal *coal)
+{
+	u32 full = coal->max_frames ?: SNULL_COAL_ADAPT_BATCH;
+
+	if (!cs->pending)
+		return;
+	if (cs->pending == 1)
+		cs->usecs = max_t(u32, cs->usecs / 2, SNULL_COAL_ADAPT_MIN_USECS);
+	else if (cs->pending >= full)
+		cs->usecs = clamp_t(u32, cs->usecs * 2, SNULL_COAL_ADAPT_MIN_USECS,
+				    SNULL_COAL_ADAPT_MAX_USECS);
+}
+
+/* Start a new moderation period and raise the queue's interrupt */
+static void snull_coal_fire(struct snull_queue *q)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	if (priv->rx_coal.adaptive)
+		snull_coal_adapt(&q->rx_coal, &priv->rx_coal);
+	if (priv->tx_coal.adaptive)
+		snull_coal_adapt(&q->tx_coal, &priv->tx_coal);
+	q->rx_coal.pending = q->tx_coal.pending = 0;
+	/* Fails harmlessly if we are the timer callback */
+	hrtimer_try_to_cancel(&q->coal_timer);
+	q->coal_armed = false;
+	spin_unlock_irqrestore(&q->lock, flags);
+
+	snull_interrupt(q->index, q);
+}
+
+static enum hrtimer_restart snull_coal_timer(struct hrtimer *timer)
+{
+	struct snull_queue *q = container_of(timer, struct snull_queue, coal_timer);
+
+	snull_coal_fire(q);
+	return HRTIMER_NORESTART;
+}
+
+/* Latch an event and raise or schedule the interrupt for it */
+static void snull_signal(struct snull_queue *q, int what)
+{
+	unsigned long flags;
+	bool fire;
+
+	spin_lock_irqsave(&q->lock, flags);
+	fire = __snull_coal_event(q, what);
+	spin_unlock_irqrestore(&q->lock, flags);
+	if (fire)
+		snull_coal_fire(q);
+}
+
+/*
+ * Append a packet to the tail of the RX list, so it is received in
+ * order. If receive interrupts are enabled the RX event is latched in
+ * the same critical section, and we return true if the caller must
+ * raise the interrupt now. Called with the lock held.
+ */
+static bool __snull_enqueue_buf(struct snull_queue *q, struct snull_packet *pkt)
+{
+	pkt->next = NULL;
+	if (q->rx_queue)
+		q->rx_tail->next = pkt;
+	else
+		q->rx_queue = pkt;
+	q->rx_tail = pkt;
+	if (!q->rx_int_enabled)
+		return false;
+	return __snull_coal_event(q, SNULL_RX_INTR);
+}
+
+/* Pop the oldest packet off the RX list; called with the lock held */
+static struct snull_packet *__snull_dequeue_buf(struct snull_queue *q)
+{
+	struct snull_packet *pkt = q->rx_queue;
+
+	if (pkt != NULL)
+		q->rx_queue = pkt->next;
+	return pkt;
+}
+
+static struct snull_packet *snull_dequeue_buf(struct snull_queue *q)
+{
+	struct snull_packet *pkt;
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->lock, flags);
+	pkt = __snull_dequeue_buf(q);
+	spin_unlock_irqrestore(&q->lock, flags);
+	return pkt;
+}
+
+/* Drop everything queued for receive; called with the lock held */
+static void __snull_drain_rx(struct snull_queue *q)
+{
+	struct snull_packet *pkt;
+
+	while ((pkt = __snull_dequeue_buf(q))) {
+		snull_rx_free(q, pkt);
+		snull_release_buffer(pkt);
+	}
+}
+
+/*
+ * Reap the TX ring: a TX-done interrupt completes every skb the
+ * engine sent since the previous one; with moderation that can be
+ * many. BQL hears about them in one go, and the slots are handed back
+ * once, at the end. Called from NAPI poll with its budget, so the skbs go to
+ * the per-CPU cache in bulk, or with a budget of 0 from anywhere else
+ * (the interrupt handler without NAPI, close), holding the queue lock.
+ */
+static void snull_tx_clean(struct snull_queue *q, int budget)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	struct snull_ring *ring = &q->pool;
+	unsigned int pkts = 0, bytes = 0;
+	unsigned int head = ring->tx_done;
+	/* Pairs with the release in snull_tx_poll() */
+	unsigned int tail = smp_load_acquire(&ring->tx_fetched);
+	struct sk_buff *skb;
+
+	if (head == tail)
+		return;
+	for (; head != tail; head++) {
+		skb = ring->tx_skbs[head & ring->mask];
+		snull_count_tx_segs(priv, skb_shinfo(skb)->gso_segs ?: 1, skb->len);
+		pkts++;
+		bytes += skb->len;
+		napi_consume_skb(skb, budget);
+	}
+	smp_store_release(&ring->tx_done, head);
+	netdev_tx_completed_queue(netdev_get_tx_queue(q->dev, q->index),
+				  pkts, bytes);
+	snull_maybe_wake_tx(q);
+}
+
+/*
+ * Drop the skbs the TX engine never sent, rung for or not: on close,
+ * with the engine disabled, xmit quiesced and bottom halves off, as the
+ * statistics want. Those it did send were
+ * reaped by snull_tx_clean() already; BQL is reset next.
+ */
+static void snull_tx_flush(struct snull_queue *q)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	struct snull_ring *ring = &q->pool;
+	unsigned int i;
+
+	for (i = ring->tx_fetched; i != ring->tx_prod; i++) {
+		dev_kfree_skb_any(ring->tx_skbs[i & ring->mask]);
+		snull_stats_inc(priv, tx_dropped);
+	}
+	ring->tx_tail = ring->tx_fetched = ring->tx_done = ring->tx_prod;
+	ring->stalled = false;
+}
+
+/*
+ * Enable and disable receive interrupts. Called with the lock held.
+ */
+static void snull_rx_ints(struct snull_queue *q, int enable)
+{
+	q->rx_int_enabled = enable;
+}
+
+/*
+ * The far end of the wire: write the frame straight into a receive
+ * page of queue 'dq' and signal a receive event there. This is the
+ * only copy the frame sees on a plain link: the receiver builds its
+ * skb (or runs XDP) on that page. No free page means a missed frame
+ * at the receiver, as on a real NIC with an empty RX ring.
+ */
+static void snull_wire_deliver(struct snull_queue *dq, struct snull_packet *pkt,
+		const struct snull_frame *f)
+{
+	struct snull_priv *dpriv = netdev_priv(dq->dev);
+	unsigned long flags;
+	bool down, filled = false, intr = false;
+
+	/* The receiver's RX timestamp: the frame reaches its buffer */
+	pkt->tstamp = READ_ONCE(dpriv->hwts.rx_filter) != HWTSTAMP_FILTER_NONE ?
+		      ktime_get_real() : 0;
+
+	/*
+	 * A receiver that is down (or being reconfigured) has no link:
+	 * the frame is lost on the wire. Checked under the lock, which
+	 * snull_release() takes to empty the queue after setting 'down'.
+	 * So is a queue out of use, which a stale RSS table may still name
+	 * (see snull_reconfigure()).
 	 */
-	struct net_device *dev = (struct net_device *)dev_id;
-	/* ... and check with hw if it's really ours */
+	spin_lock_irqsave(&dq->lock, flags);
+	down = READ_ONCE(dpriv->down) ||
+	       dq->index >= READ_ONCE(dpriv->num_queues);
+	if (likely(!down)) {
+		filled = snull_rx_fill(dq, pkt, f);
+		if (likely(filled))
+			intr = __snull_enqueue_buf(dq, pkt);
+		else
+			dq->stats.rx_drops++;
+	}
+	spin_unlock_irqrestore(&dq->lock, flags);
+	if (filled)
+		trace_snull_rx_enqueue(dq->dev, dq->index, pkt->datalen,
+				       pkt->rss_hash);
+
+	if (unlikely(!filled)) {
+		if (!down)
+			snull_stats_inc(dpriv, rx_dropped);
+		snull_release_buffer(pkt);
+		return;
+	}
+	if (intr)
+		snull_coal_fire(dq); // simulate Rx interrupt
+}
 
-//QP;
-	/* paranoid */
-	if (!dev)
+/*
+ * Link emulation. Frames sent on an impaired link are copied off the
+ * sender's buffer and put on the queue's timing wheel, to be delivered
+ * when their tick comes. This happens before any qdisc, at a fraction
+ * of the cost of stacking netem and tbf.
+ */
+static inline bool snull_chance(u32 ppm)
+{
+	return ppm && get_random_u32_below(1000000) < ppm;
+}
+
+static inline u64 snull_wire_tick(u64 ns)
+{
+	return div_u64(ns, SNULL_WIRE_TICK_NS);
+}
+
+/* Decide whether the link loses a frame; wire lock held */
+static bool snull_link_lose(struct snull_wire *wire, const struct snull_link *link)
+{
+	u32 loss = READ_ONCE(link->loss_ppm);
+
+	if (READ_ONCE(link->ge_p_ppm)) {
+		if (wire->ge_bad)
+			wire->ge_bad = !snull_chance(READ_ONCE(link->ge_r_ppm));
+		else
+			wire->ge_bad = snull_chance(READ_ONCE(link->ge_p_ppm));
+		if (wire->ge_bad)
+			loss = READ_ONCE(link->ge_bad_loss_ppm);
+	}
+	return snull_chance(loss);
+}
+
+/* Program the timer for 'tick' unless it is set for an earlier one */
+static void snull_wire_arm(struct snull_wire *wire, u64 tick)
+{
+	if (wire->armed && wire->next_tick <= tick)
 		return;
+	wire->armed = true;
+	wire->next_tick = tick;
+	hrtimer_start(&wire->timer, ns_to_ktime(tick * SNULL_WIRE_TICK_NS),
+		      HRTIMER_MODE_ABS_SOFT);
+}
 
-	/* Lock the device */
-	priv = netdev_priv(dev);
-	assert (priv != NULL);
-	spin_lock(&priv->lock);
+/*
+ * When a frame arrives: the token bucket (GCRA: it may leave once the
+ * link has caught up to within 'burst' bytes) gives the time it starts
+ * out and how long it takes to serialize; then comes the propagation
+ * delay, give or take the jitter. A reordered frame skips the delay
+ * and overtakes those in flight. A frame due beyond the wheel's horizon,
+ * or one more than its limit holds, is dropped, like the tail drop of
+ * a shaper's queue. Either way the descriptor goes back right away.
+ */
+static void snull_wire_impair(struct snull_queue *q, struct snull_wire *wire,
+		struct snull_queue *dq, struct snull_packet *pkt, const struct snull_frame *f)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	const struct snull_link *link = &priv->link;
+	u32 rate = READ_ONCE(link->rate_kbit);
+	u32 jitter = READ_ONCE(link->jitter_us);
+	unsigned int len = snull_frame_len(f);
+	u64 now, depart, due, tick, tat, tx_ns = 0, credit;
+	struct snull_wire_frame *wf;
+	unsigned long flags;
+	s64 offs;
+	int s;
 
-	/* retrieve statusword: real netdevices use I/O instructions */
-	statusword = priv->status;
-	priv->status = 0;
-	if (statusword & SNULL_RX_INTR) {
-		/* send it to snull_rx for handling */
-		pkt = priv->rx_queue;
-		if (pkt) {
-			priv->rx_queue = pkt->next;
-			MSG("Rx path: Invoking snull_rx now ...\n");
-			snull_rx(dev, pkt);
-		}
+	wf = kmalloc(struct_size(wf, data, len), GFP_ATOMIC);
+	if (unlikely(!wf)) {
+		snull_stats_inc(priv, tx_dropped);
+		snull_release_buffer(pkt);
+		return;
 	}
-	if (statusword & SNULL_TX_INTR) {
-		/* a transmission is over: free the skb */
-		priv->stats.tx_packets++;
-		priv->stats.tx_bytes += priv->tx_packetlen;
-		dev_kfree_skb(priv->skb);
-		MSG("Tx path: Tx done, skb freed.\n");
+	snull_frame_copy(f, wf->data);
+	wf->len = len;
+	wf->dest = dq;
+	wf->rss_hash = pkt->rss_hash;
+	wf->rss_type = pkt->rss_type;
+	wf->sent_ns = pkt->sent_ns;
+	wf->next = NULL;
+	snull_release_buffer(pkt);
+
+	spin_lock_irqsave(&wire->lock, flags);
+	if (snull_link_lose(wire, link)) {
+		wire->lost++;
+		goto drop;
+	}
+	if (wire->backlog >= READ_ONCE(link->limit)) {
+		wire->overlimit++;
+		goto drop;
+	}
+
+	/* The bucket only pays for frames that make it onto the wheel */
+	now = ktime_get_ns();
+	depart = now;
+	tat = wire->tat;
+	if (rate) {
+		tx_ns = div_u64((u64)len * 8 * NSEC_PER_MSEC, rate);
+		credit = div_u64((u64)READ_ONCE(link->burst) * 8 * NSEC_PER_MSEC, rate);
+		if (tat > now + credit)
+			depart = tat - credit;
+		tat = max(tat, now) + tx_ns;
+	}
+	due = depart + tx_ns;
+	if (!snull_chance(READ_ONCE(link->reorder_ppm))) {
+		due += (u64)READ_ONCE(link->delay_us) * NSEC_PER_USEC;
+		if (jitter) {
+			offs = (s64)get_random_u32_below(2 * jitter + 1) - jitter;
+			due = max_t(s64, due + offs * NSEC_PER_USEC, depart);
+		}
 	}
 
-	/* Unlock the device and we are done */
-	spin_unlock(&priv->lock);
-	if (pkt) 
-		snull_release_buffer(pkt); /* Do this outside the lock! */
+	if (!wire->backlog)
+		wire->base = snull_wire_tick(now);
+	tick = max(snull_wire_tick(due), wire->base + 1);
+	if (tick - wire->base >= SNULL_WIRE_SLOTS) {
+		wire->overlimit++;
+		goto drop;
+	}
+	s = tick & (SNULL_WIRE_SLOTS - 1);
+	if (wire->slot[s].head)
+		wire->slot[s].tail->next = wf;
+	else
+		wire->slot[s].head = wf;
+	wire->slot[s].tail = wf;
+	wire->backlog++;
+	wire->tat = tat;
+	snull_wire_arm(wire, tick);
+	spin_unlock_irqrestore(&wire->lock, flags);
 	return;
+
+  drop:
+	spin_unlock_irqrestore(&wire->lock, flags);
+	kfree(wf);
 }
 
 /*
- * A NAPI interrupt handler.
+ * The wheel's timer: take every frame whose tick has come, set the
+ * timer for the next non-empty slot, and deliver outside the lock.
+ * The timer is re-armed with hrtimer_start(), never by returning
+ * HRTIMER_RESTART, so it can't collide with the transmit side arming it.
+ *
+ * Each frame takes a descriptor of the sending queue to be received
+ * in, all of them under one hold of the TX queue lock, which the ring
+ * needs. One that finds none is missed at the receiver, as with no
+ * receive buffer.
  */
-static void snull_napi_interrupt(int irq, void *dev_id)
+static enum hrtimer_restart snull_wire_timer(struct hrtimer *timer)
 {
-	int statusword;
-	struct snull_priv *priv;
+	struct snull_wire *wire = container_of(timer, struct snull_wire, timer);
+	struct snull_wire_frame *list = NULL, **tail = &list, *wf;
+	struct snull_queue *q = wire->q;
+	struct netdev_queue *txq;
+	struct snull_priv *dpriv;
+	struct snull_packet *pkt;
+	struct snull_frame f;
+	unsigned long flags;
+	u64 now_tick;
+	int s;
+
+	spin_lock_irqsave(&wire->lock, flags);
+	wire->armed = false;
+	now_tick = snull_wire_tick(ktime_get_ns());
+	while (wire->backlog && wire->base < now_tick) {
+		s = ++wire->base & (SNULL_WIRE_SLOTS - 1);
+		for (wf = wire->slot[s].head; wf; wf = wf->next) {
+			*tail = wf;
+			tail = &wf->next;
+			wire->backlog--;
+		}
+		wire->slot[s].head = NULL;
+	}
+	if (wire->backlog) {
+		s = (wire->base + 1) & (SNULL_WIRE_SLOTS - 1);
+		while (!wire->slot[s].head)
+			s = (s + 1) & (SNULL_WIRE_SLOTS - 1);
+		snull_wire_arm(wire, wire->base + 1 +
+			       ((s - wire->base - 1) & (SNULL_WIRE_SLOTS - 1)));
+	}
+	spin_unlock_irqrestore(&wire->lock, flags);
+	if (!list)
+		return HRTIMER_NORESTART;
+
+	txq = netdev_get_tx_queue(q->dev, q->index);
+	__netif_tx_lock(txq, smp_processor_id());
+	for (wf = list; wf; wf = wf->next)
+		wf->pkt = snull_get_tx_buffer(q);
+	__netif_tx_unlock(txq);
+
+	while ((wf = list)) {
+		list = wf->next;
+		pkt = wf->pkt;
+		if (likely(pkt)) {
+			pkt->rss_hash = wf->rss_hash;
+			pkt->rss_type = wf->rss_type;
+			pkt->sent_ns = wf->sent_ns;
+			snull_frame_init(&f, wf->data, wf->len);
+			snull_wire_deliver(wf->dest, pkt, &f);
+		} else {
+			dpriv = netdev_priv(wf->dest->dev);
+			if (!READ_ONCE(dpriv->down))
+				snull_stats_inc(dpriv, rx_dropped);
+		}
+		kfree(wf);
+	}
+	return HRTIMER_NORESTART;
+}
+
+/* Throw away everything on the wire; the device is going down */
+static void snull_wire_flush(struct snull_wire *wire)
+{
+	struct snull_wire_frame *wf, *next;
+	unsigned long flags;
+	int s;
+
+	hrtimer_cancel(&wire->timer);
+	spin_lock_irqsave(&wire->lock, flags);
+	for (s = 0; s < SNULL_WIRE_SLOTS; s++) {
+		for (wf = wire->slot[s].head; wf; wf = next) {
+			next = wf->next;
+			kfree(wf);
+		}
+		wire->slot[s].head = NULL;
+	}
+	wire->backlog = 0;
+	wire->armed = false;
+	spin_unlock_irqrestore(&wire->lock, flags);
+}
+
+/*
+ * Put a frame on the wire, from TX queue 'q' to device 'ddev', whose
+ * RSS picks the RX queue: take a TX descriptor and deliver the frame,
+ * right away or, on an emulated link, when the wire says so. A frame
+ * lost on the receiving side still counts as sent.
+ *
+ * Called with the TX queue lock held. Returns -ENOBUFS if there was
+ * no TX descriptor, 0 otherwise.
+ */
+static int snull_wire_xmit(struct snull_queue *q, struct net_device *ddev,
+		const struct snull_frame *f)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	struct snull_packet *tx_buffer;
+	struct snull_queue *dq;
+	struct snull_wire *wire;
+
+	tx_buffer = snull_get_tx_buffer(q);
+	if (unlikely(!tx_buffer))
+		return -ENOBUFS;
+	tx_buffer->sent_ns = f->sent_ns;
+	dq = snull_rss_steer(ddev, f, tx_buffer);
+
+	/* Pairs with the release in snull_wire_alloc() */
+	wire = smp_load_acquire(&q->wire);
+	if (wire && READ_ONCE(priv->link.active))
+		snull_wire_impair(q, wire, dq, tx_buffer, f);
+	else
+		snull_wire_deliver(dq, tx_buffer, f);
+	return 0;
+}
+
+/*
+ * Send a frame from TX queue 'q' to wherever the topology takes it: in
+ * pair mode, the peer device, with its address put in h_dest on the
+ * way (the devices are NOARP, so the stack addressed the frame to the
+ * sender itself; LDD3's snull_header did the same); as a switch, the port its destination
+ * was learnt on, or every other port for broadcast, multicast and
+ * unknown destinations. Each copy a flood makes takes a descriptor of
+ * its own, and each copy that finds none is a TX drop. Called with the
+ * TX queue lock held; returns -ENOBUFS if nothing could be sent for
+ * lack of descriptors, leaving the frame itself to the caller.
+ */
+static int snull_forward(struct snull_queue *q, const struct snull_frame *f)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	const struct ethhdr *eth = f->head;	/* always in the linear piece */
+	struct net_device *peer;
+	struct snull_frame pf;
+	int port, i, lost = 0, err = -ENOBUFS;
+
+	if (!l2_switch) {
+		peer = snull_peer(q->dev);
+		if (is_multicast_ether_addr(eth->h_dest))
+			return snull_wire_xmit(q, peer, f);
+		/* On the copy: the skb's headers may be shared with a clone */
+		pf = *f;
+		pf.dest_addr = peer->dev_addr;
+		return snull_wire_xmit(q, peer, &pf);
+	}
+
+	snull_fdb_learn(eth->h_source, priv->index);
+	port = snull_fdb_lookup(eth->h_dest);
+	if (port == priv->index)
+		return 0;	/* never sent back where it came from */
+	if (port >= 0)
+		return snull_wire_xmit(q, snull_devs[port], f);
+
+	for (i = 0; i < num_devs; i++) {
+		if (i == priv->index)
+			continue;
+		if (!snull_wire_xmit(q, snull_devs[i], f))
+			err = 0;
+		else
+			lost++;
+	}
+	/* If no copy went, the last one lost is the caller's to account for */
+	if (err)
+		lost--;
+	while (lost-- > 0)
+		snull_stats_inc(priv, tx_dropped);
+	return err;
+}
+
+/*
+ * Send frames from XDP (XDP_TX and ndo_xdp_xmit) on TX queue 'qidx'.
+ * Unlike ndo_start_xmit, these callers don't hold the TX queue lock,
+ * which the descriptor ring relies on, so take it here. The frames go
+ * where anything else transmitted on 'dev' would. Returns the number
+ * of frames sent.
+ */
+static int snull_xdp_xmit_frames(struct net_device *dev, u16 qidx,
+		void **data, u32 *len, int n)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, qidx);
+	struct snull_frame f;
+	int i;
+
+	__netif_tx_lock(txq, smp_processor_id());
+	/* Under the TX lock, so that snull_reconfigure() can wait us out */
+	if (unlikely(READ_ONCE(priv->down))) {
+		__netif_tx_unlock(txq);
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		snull_frame_init(&f, data[i], len[i]);
+		if (snull_forward(&priv->queues[qidx], &f))
+			break;
+		snull_count_tx(priv, len[i]);
+	}
+	__netif_tx_unlock(txq);
+	return i;
+}
+
+/*
+ * Run the XDP program on a received frame, before any skb exists.
+ * Returns XDP_PASS if the frame should go up the stack (the program
+ * may have moved xdp->data around); for any other verdict the page
+ * has been handed on or recycled.
+ *
+ * Pages go back to the pool with allow_direct=false: senders allocate
+ * from it on other CPUs, so its lockless cache is off limits here.
+ */
+static u32 snull_run_xdp(struct snull_queue *q, struct bpf_prog *prog,
+		struct snull_packet *pkt, struct xdp_buff *xdp)
+{
+	struct net_device *dev = q->dev;
+	struct snull_priv *priv = netdev_priv(dev);
+	void *data;
+	u32 act, len;
+
+	xdp_init_buff(xdp, SNULL_RX_TRUESIZE, &q->xdp_rxq);
+	xdp_prepare_buff(xdp, page_address(pkt->page), SNULL_RX_HEADROOM,
+			 pkt->datalen, true);
+
+	act = bpf_prog_run_xdp(prog, xdp);
+	switch (act) {
+	case XDP_PASS:
+		return XDP_PASS;
+	case XDP_TX:
+		/* Back out the interface it came in on */
+		data = xdp->data;
+		len = xdp->data_end - xdp->data;
+		if (snull_xdp_xmit_frames(dev, q->index, &data, &len, 1) != 1)
+			goto drop;
+		page_pool_put_full_page(q->page_pool, pkt->page, false);
+		return XDP_TX;
+	case XDP_REDIRECT:
+		if (xdp_do_redirect(dev, xdp, prog))
+			goto drop;
+		return XDP_REDIRECT;
+	default:
+		bpf_warn_invalid_xdp_action(dev, prog, act);
+		fallthrough;
+	case XDP_ABORTED:
+		trace_xdp_exception(dev, prog, act);
+		fallthrough;
+	case XDP_DROP:
+	drop:
+		snull_stats_inc(priv, rx_dropped);
+		page_pool_put_full_page(q->page_pool, pkt->page, false);
+		return XDP_DROP;
+	}
+}
+
+/*
+ * Zero-copy receive: the frame sits in a buffer of the AF_XDP umem
+ * bound to this queue. XDP_REDIRECT to the socket hands it over with
+ * no copy; XDP_PASS has to copy it into an skb, as umem memory can't
+ * go up the stack. The senders filling this queue allocate from the
+ * same buffer pool, so every pool operation is done under the queue's
+ * lock. Returns an skb for XDP_PASS, NULL otherwise.
+ */
+static struct sk_buff *snull_rx_zc(struct snull_queue *q, struct bpf_prog *prog,
+		struct xdp_buff *xdp, bool *redirect)
+{
+	struct net_device *dev = q->dev;
+	struct snull_priv *priv = netdev_priv(dev);
+	struct sk_buff *skb = NULL;
+	unsigned long flags;
+	void *data;
+	u32 act, len;
+	int err;
+
+	act = prog ? bpf_prog_run_xdp(prog, xdp) : XDP_PASS;
+	data = xdp->data;
+	len = xdp->data_end - xdp->data;
+	switch (act) {
+	case XDP_REDIRECT:
+		spin_lock_irqsave(&q->lock, flags);
+		err = xdp_do_redirect(dev, xdp, prog);
+		spin_unlock_irqrestore(&q->lock, flags);
+		if (!err) {
+			*redirect = true;
+			return NULL;
+		}
+		snull_stats_inc(priv, rx_dropped);
+		break;
+	case XDP_PASS:
+		skb = napi_alloc_skb(&q->napi, len);
+		if (skb)
+			skb_put_data(skb, data, len);
+		else
+			snull_stats_inc(priv, rx_dropped);
+		break;
+	case XDP_TX:
+		if (snull_xdp_xmit_frames(dev, q->index, &data, &len, 1) != 1)
+			snull_stats_inc(priv, rx_dropped);
+		break;
+	default:
+		bpf_warn_invalid_xdp_action(dev, prog, act);
+		fallthrough;
+	case XDP_ABORTED:
+		trace_xdp_exception(dev, prog, act);
+		fallthrough;
+	case XDP_DROP:
+		snull_stats_inc(priv, rx_dropped);
+		break;
+	}
+
+	spin_lock_irqsave(&q->lock, flags);
+	xsk_buff_free(xdp);
+	spin_unlock_irqrestore(&q->lock, flags);
+	return skb;
+}
+
+/*
+ * Zero-copy transmit: pull descriptors off the TX ring of the AF_XDP
+ * socket bound to this queue and put them on the wire straight from
+ * the umem. The wire copy is synchronous, so they are completed right
+ * away. Only runs from this queue's NAPI poll. Returns descriptors
+ * consumed, sent or dropped.
+ */
+static int snull_xsk_tx(struct snull_queue *q, int budget)
+{
+	struct net_device *dev = q->dev;
+	struct snull_priv *priv = netdev_priv(dev);
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, q->index);
+	struct xsk_buff_pool *pool = q->xsk_pool;
+	struct snull_frame f;
+	struct xdp_desc desc;
+	int sent = 0;
+
+	__netif_tx_lock(txq, smp_processor_id());
+	/* Only peek when there's a descriptor to put it in */
+	while (sent < budget && snull_pool_avail(&q->pool) &&
+	       xsk_tx_peek_desc(pool, &desc)) {
+		snull_frame_init(&f, xsk_buff_raw_get_data(pool, desc.addr), desc.len);
+		/*
+		 * A frame that found no descriptor (a flood, say) is lost;
+		 * its umem buffer is completed all the same, or userspace
+		 * would never get it back.
+		 */
+		if (likely(!snull_forward(q, &f)))
+			snull_count_tx(priv, desc.len);
+		else
+			snull_stats_inc(priv, tx_dropped);
+		sent++;
+	}
+	__netif_tx_unlock(txq);
+
+	if (sent) {
+		xsk_tx_completed(pool, sent);
+		xsk_tx_release(pool);
+	}
+	/* We only look at the TX ring when kicked (ndo_xsk_wakeup) */
+	if (xsk_uses_need_wakeup(pool))
+		xsk_set_tx_need_wakeup(pool);
+	return sent;
+}
+
+/*
+ * NAPI receive of one buffer: run XDP if a program is attached, then
+ * build the skb for the stack. Returns NULL if XDP consumed the frame
+ * or it was dropped.
+ */
+static struct sk_buff *snull_napi_rx_buf(struct snull_queue *q, struct bpf_prog *prog,
+		struct snull_packet *pkt, bool *redirect)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	struct sk_buff *skb;
+	struct xdp_buff xdp;
+	u32 act;
+
+	if (pkt->xsk)
+		return snull_rx_zc(q, prog, pkt->xsk, redirect);
+
+	if (!prog) {
+		skb = snull_build_skb(q, pkt->page, SNULL_RX_HEADROOM,
+				      pkt->datalen, true);
+	} else {
+		/* Native XDP: the program sees the frame in the ring */
+		act = snull_run_xdp(q, prog, pkt, &xdp);
+		if (act != XDP_PASS) {
+			*redirect |= act == XDP_REDIRECT;
+			return NULL;
+		}
+		skb = snull_build_skb(q, pkt->page, xdp.data - xdp.data_hard_start,
+				      xdp.data_end - xdp.data, true);
+		if (skb && xdp.data_meta < xdp.data)
+			skb_metadata_set(skb, xdp.data - xdp.data_meta);
+	}
+	if (! skb) {
+		if (printk_ratelimit())
+			printk(KERN_NOTICE "%s: packet dropped\n", DRVNAME);
+		snull_stats_inc(priv, rx_dropped);
+	}
+	return skb;
+}
+
+/*
+ * Tell XDP what memory a queue receives into: its page pool, or the
+ * AF_XDP buffer pool while a zero-copy socket is bound.
+ */
+static int snull_reg_rxq_mem(struct snull_queue *q)
+{
+	int err;
+
+	if (!q->xsk_pool)
+		return xdp_rxq_info_reg_mem_model(&q->xdp_rxq, MEM_TYPE_PAGE_POOL,
+						  q->page_pool);
+	err = xdp_rxq_info_reg_mem_model(&q->xdp_rxq, MEM_TYPE_XSK_BUFF_POOL, NULL);
+	if (!err)
+		xsk_pool_set_rxq_info(q->xsk_pool, &q->xdp_rxq);
+	return err;
+}
+
+/*
+ * Open and close
+ */
+
+static int snull_open(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+	u8 addr[ETH_ALEN];
+	int i, err;
+
+	/* request_region(), request_irq(), ....  (like fops->open) */
+	for (i = 0; i < priv->num_queues; i++)
+		if (!priv->queues[i].pool.descs || !priv->queues[i].page_pool)
+			return -ENOMEM; /* pool allocation failed at init */
+
+	/* Tell XDP about each RX queue and the memory it receives into */
+	for (i = 0; i < priv->num_queues; i++) {
+		q = &priv->queues[i];
+		err = xdp_rxq_info_reg(&q->xdp_rxq, dev, i, q->napi.napi_id);
+		if (err)
+			goto out_unreg;
+		err = snull_reg_rxq_mem(q);
+		if (err) {
+			xdp_rxq_info_unreg(&q->xdp_rxq);
+			goto out_unreg;
+		}
+	}
+
+	/* 
+	 * Assign the hardware address of the board: use "\0SNULx", where
+	 * x is '0' plus the device number. The first byte is '\0' to avoid
+	 * being a multicast address (the first byte of multicast addrs is odd).
+	 */
+	memcpy(addr, "\0SNUL0", ETH_ALEN);
+	addr[ETH_ALEN-1] += priv->index; /* \0SNUL1, \0SNUL2, ... */
+	eth_hw_addr_set(dev, addr);
+	for (i = 0; i < priv->num_queues; i++) {
+		napi_enable(&priv->queues[i].tx_napi);
+		if (use_napi)
+			napi_enable(&priv->queues[i].napi);
+	}
+	WRITE_ONCE(priv->down, false);	/* the wire may deliver to us now */
+	netif_tx_start_all_queues(dev);
+	return 0;
+
+  out_unreg:
+	while (i--)
+		xdp_rxq_info_unreg(&priv->queues[i].xdp_rxq);
+	return err;
+}
+
+static int snull_release(struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+	unsigned long flags;
+	int i;
+
+    /* release ports, irq and such -- like fops->close */
+
+	WRITE_ONCE(priv->down, true);	/* nor receive, see snull_wire_deliver() */
+	netif_tx_stop_all_queues(dev); /* can't transmit any more */
+
+	/*
+	 * Quiesce the TX engine, polling and the moderation timer, then
+	 * drop whatever is still queued for receive, complete what a
+	 * pending TX-done would have, drop what the engine never got to,
+	 * and leave receive interrupts enabled for the next open.
+	 */
+	for (i = 0; i < priv->num_queues; i++) {
+		q = &priv->queues[i];
+		napi_disable(&q->tx_napi);
+		if (use_napi)
+			napi_disable(&q->napi);
+		hrtimer_cancel(&q->coal_timer);
+		if (q->wire)
+			snull_wire_flush(q->wire);
+		/*
+		 * Bottom halves off: the statistics need it, and enabling
+		 * them again runs the senders' TX engines the drain restarts
+		 */
+		local_bh_disable();
+		spin_lock_irqsave(&q->lock, flags);
+		__snull_drain_rx(q);
+		snull_tx_clean(q, 0);
+		q->status = 0;
+		q->rx_coal.pending = q->tx_coal.pending = 0;
+		q->coal_armed = false;
+		snull_rx_ints(q, 1);
+		spin_unlock_irqrestore(&q->lock, flags);
+		/* The core quiesced xmit already; nothing rings the doorbell now */
+		snull_tx_flush(q);
+		local_bh_enable();
+		netdev_tx_reset_queue(netdev_get_tx_queue(dev, i));
+		xdp_rxq_info_unreg(&q->xdp_rxq);
+	}
+	return 0;
+}
+
+/*
+ * Configuration changes (passed on by ifconfig)
+ */
+static int snull_config(struct net_device *dev, struct ifmap *map)
+{
+	if (dev->flags & IFF_UP) /* can't act on a running interface */
+		return -EBUSY;
+
+	/* Don't allow changing the I/O address */
+	if (map->base_addr != dev->base_addr) {
+		printk(KERN_WARNING "%s: Can't change I/O address\n", DRVNAME);
+		return -EOPNOTSUPP;
+	}
+
+	/* Allow changing the IRQ */
+	if (map->irq != dev->irq) {
+		dev->irq = map->irq;
+        	/* request_irq() is delayed to open-time */
+	}
+
+	/* ignore other fields */
+	return 0;
+}
+
+/*
+ * Receive a packet: retrieve, encapsulate and pass over to upper levels.
+ * Called with the queue's spinlock held.
+ */
+static void snull_rx(struct snull_queue *q, struct snull_packet *pkt)
+{
+	struct sk_buff *skb;
+	struct net_device *dev = q->dev;
+	struct snull_priv *priv = netdev_priv(dev);
+
+	/*
+	 * The packet has been retrieved from the transmission
+	 * medium. Build an skb around it, so upper layers can handle it.
+	 * The data is already in place in a page-pool page (a real NIC
+	 * would have DMA'd it there), so no copy is needed.
+	 */
+	skb = snull_build_skb(q, pkt->page, SNULL_RX_HEADROOM, pkt->datalen, false);
+	if (!skb) {
+		if (printk_ratelimit())
+			printk(KERN_NOTICE "%s rx: low on mem - packet dropped\n", DRVNAME);
+		snull_stats_inc(priv, rx_dropped);
+		goto out;
+	}
+
+	/* Write metadata, and then pass to the receive level */
+	skb->dev = dev;
+	skb->protocol = eth_type_trans(skb, dev);
+	skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+	skb_record_rx_queue(skb, q->index);
+	snull_rx_hash(dev, skb, pkt);
+	snull_rx_tstamp(dev, skb, pkt);
+	snull_count_rx(priv, pkt->datalen);
+
+	trace_snull_rx_deliver(dev, q->index, skb);
+	snull_lat_record(pkt->sent_ns);
+	if (unlikely(snull_bench_sink(skb)))
+		goto out;
+	netif_rx(skb);	/* a backlog drop shows in /proc/net/softnet_stat */
+  out:
+	return;
+}
+    
+
+/*
+ * The poll implementation.
+ */
+static int snull_poll(struct napi_struct *napi, int budget)
+{
+	int npackets = 0;
+	struct sk_buff *skb;
+	struct snull_queue *q = container_of(napi, struct snull_queue, napi);
+	struct net_device *dev = q->dev;
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_packet *pkt;
+	struct bpf_prog *prog;
+	bool redirect = false;
+	unsigned long flags;
+	int tx_work = 0;
+	u64 sent_ns;
+    
+	q->stats.napi_polls++;
+	/* TX completions first: they free room for the stack to send */
+	snull_tx_clean(q, budget);
+	rcu_read_lock();
+	prog = rcu_dereference(priv->xdp_prog);
+	while (npackets < budget) {
+		pkt = snull_dequeue_buf(q);
+		if (!pkt)
+			break;
+		npackets++;	/* a dropped packet is work done, too */
+		snull_count_rx(priv, pkt->datalen);
+
+		skb = snull_napi_rx_buf(q, prog, pkt, &redirect);
+		if (skb) {	/* the descriptor is the sender's again once released */
+			snull_rx_hash(dev, skb, pkt);
+			snull_rx_tstamp(dev, skb, pkt);
+		}
+		sent_ns = pkt->sent_ns;
+		snull_release_buffer(pkt);
+		if (!skb)
+			continue;	/* consumed by XDP, or dropped */
+		skb->dev = dev;
+		skb->protocol = eth_type_trans(skb, dev);
+		skb->ip_summed = CHECKSUM_UNNECESSARY; /* don't check it */
+		skb_record_rx_queue(skb, q->index);
+		/* Lets a busy-polling socket find this queue's poll loop */
+		skb_mark_napi_id(skb, napi);
+		trace_snull_rx_deliver(dev, q->index, skb);
+		snull_lat_record(sent_ns);
+		if (unlikely(snull_bench_sink(skb)))
+			continue;	/* counted and freed by the benchmark */
+		if (use_gro)
+			napi_gro_receive(napi, skb);
+		else
+			netif_receive_skb(skb);
+	}
+	/* Push out the frames XDP redirected, before leaving NAPI context */
+	if (redirect)
+		xdp_do_flush();
+	rcu_read_unlock();
+
+	/* An AF_XDP socket in zero-copy mode transmits from here too */
+	if (q->xsk_pool)
+		tx_work = snull_xsk_tx(q, budget);
+	trace_snull_napi_poll(dev, q->index, budget, npackets, tx_work);
+
+	/* Budget used up: stay in polling mode, the core will call us again */
+	if (npackets == budget || tx_work == budget) {
+		q->stats.budget_exhausted++;
+		return budget;
+	}
+
+	/*
+	 * We processed all packets; tell the kernel and reenable ints.
+	 * napi_complete_done() also flushes what GRO is holding.
+	 * A packet queued while interrupts were off raised no interrupt,
+	 * so look again under the lock and keep polling if one slipped in.
+	 */
+	if (napi_complete_done(napi, npackets)) {
+		spin_lock_irqsave(&q->lock, flags);
+		if (q->rx_queue)
+			napi_schedule(napi);
+		else
+			snull_rx_ints(q, 1);
+		spin_unlock_irqrestore(&q->lock, flags);
+	}
+	return npackets;
+}
+
+
+/*
+ * The typical interrupt entry point. Every queue has its own vector:
+ * 'irq' is the queue index and 'dev_id' the queue itself.
+ */
+static void snull_regular_interrupt(int irq, void *dev_id)
+{
+	int statusword;
+	struct snull_priv *priv;
+	struct snull_packet *pkt = NULL;
+	struct net_device *dev;
+	/*
+	 * As usual, check the "device" pointer to be sure it is
+	 * really interrupting.
+	 * Then assign "struct device *dev"
+	 */
+	struct snull_queue *q = (struct snull_queue *)dev_id;
+	/* ... and check with hw if it's really ours */
+
+	/* paranoid */
+	if (!q)
+		return;
+
+	/* Lock the queue */
+	dev = q->dev;
+	priv = netdev_priv(dev);
+	assert (priv != NULL);
+	spin_lock(&q->lock);
+	q->stats.interrupts++;
+
+	/* retrieve statusword: real netdevices use I/O instructions */
+	statusword = q->status;
+	q->status = 0;
+	trace_snull_irq(dev, q->index, statusword);
+	if (statusword & SNULL_RX_INTR) {
+		/*
+		 * Send them to snull_rx for handling; with moderation one
+		 * interrupt stands for several frames. Releasing the buffer
+		 * only takes the sending ring's producer lock.
+		 */
+		while ((pkt = __snull_dequeue_buf(q))) {
+			snull_rx(q, pkt);
+			snull_release_buffer(pkt);
+		}
+	}
+	if (statusword & SNULL_TX_INTR) {
+		/* transmissions are over: free the skbs */
+		snull_tx_clean(q, 0);
+	}
+
+	/* Unlock the queue and we are done */
+	spin_unlock(&q->lock);
+	return;
+}
+
+/*
+ * A NAPI interrupt handler.
+ */
+static void snull_napi_interrupt(int irq, void *dev_id)
+{
+	int statusword;
+	struct snull_priv *priv;
+	struct net_device *dev;
+
+	/*
+	 * As usual, check the "device" pointer for shared handlers.
+	 * Then assign "struct device *dev"
+	 */
+	struct snull_queue *q = (struct snull_queue *)dev_id;
+	/* ... and check with hw if it's really ours */
+
+	/* paranoid */
+	if (!q)
+		return;
+
+	/* Lock the queue */
+	dev = q->dev;
+	priv = netdev_priv(dev);
+	spin_lock(&q->lock);
+	q->stats.interrupts++;
+
+	/* retrieve statusword: real netdevices use I/O instructions */
+	statusword = q->status;
+	q->status = 0;
+	trace_snull_irq(dev, q->index, statusword);
+	if (statusword & SNULL_RX_INTR) {
+		snull_rx_ints(q, 0);  /* Disable further interrupts */
+		/* Turn on (NAPI) polling; snull_poll() reenables interrupts */
+		napi_schedule(&q->napi);
+	}
+	if (statusword & SNULL_TX_INTR) {
+		/* transmissions are over: snull_poll() frees the skbs */
+		napi_schedule(&q->napi);
+	}
+
+	/* Unlock the queue and we are done */
+	spin_unlock(&q->lock);
+	return;
+}
+
+
+/*
+ * Put one frame on the wire (low level interface).
+ *
+ * This function deals with hw details. This interface loops
+ * back the packet to the other snull interface (if any).
+ * In other words, this function implements the snull behaviour,
+ * while all other procedures are rather device-independent.
+ * Echo requests don't go anywhere: the echo reflector sends the reply
+ * back to this very queue.
+ */
+static void snull_hw_tx_frame(struct snull_queue *q, struct snull_frame *f)
+{
+	struct snull_priv *priv = netdev_priv(q->dev);
+	int err;
+
+	f->echo = echo_reflect && !l2_switch && snull_echo_request(f);
+	if (f->echo)
+		err = snull_wire_xmit(q, q->dev, f); // Rx intr on same interface
+	else
+		err = snull_forward(q, f); // Rx intr on peer interface
+
+	if (unlikely(err)) {
+		/* snull_tx() checks for room first; this is only a safety net */
+		snull_stats_inc(priv, tx_dropped);
+	}
+}
+
+/*
+ * TSO, the way a NIC does it: cut the payload of a GSO skb into
+ * gso_size pieces and send each behind a copy of the headers, patched
+ * for that segment (IP length and ID, TCP sequence number and flags),
+ * with the TCP checksum filled in on the wire. The stack handled one
+ * super-packet instead of gso_segs frames.
+ */
+static void snull_hw_tso(struct snull_queue *q, struct sk_buff *skb)
+{
+	u8 hdr[SNULL_TSO_MAX_HDR];
+	unsigned int hdr_len = skb_tcp_all_headers(skb);
+	unsigned int nh_off = skb_network_offset(skb);
+	unsigned int th_off = skb_transport_offset(skb);
+	unsigned int mss = skb_shinfo(skb)->gso_size;
+	unsigned int gso_type = skb_shinfo(skb)->gso_type;
+	struct iphdr *iph = (struct iphdr *)(hdr + nh_off);
+	struct ipv6hdr *ip6h = (struct ipv6hdr *)(hdr + nh_off);
+	struct tcphdr *th = (struct tcphdr *)(hdr + th_off);
+	unsigned int off, seglen, tcplen;
+	struct snull_frame f;
+	bool fin, psh;
+	u16 id = 0;
+	u32 seq;
+
+	/* snull_features_check() keeps longer headers away from us */
+	skb_copy_bits(skb, 0, hdr, hdr_len);
+	seq = ntohl(th->seq);
+	fin = th->fin;
+	psh = th->psh;
+	if (gso_type & SKB_GSO_TCPV4)
+		id = ntohs(iph->id);
+
+	for (off = hdr_len; off < skb->len; off += seglen) {
+		seglen = min(mss, skb->len - off);
+		tcplen = hdr_len - th_off + seglen;
+
+		th->seq = htonl(seq);
+		seq += seglen;
+		/* FIN and PSH go on the last segment, CWR on the first only */
+		th->fin = fin && off + seglen == skb->len;
+		th->psh = psh && off + seglen == skb->len;
+		if (off != hdr_len)
+			th->cwr = 0;
+
+		if (gso_type & SKB_GSO_TCPV4) {
+			iph->tot_len = htons(hdr_len - nh_off + seglen);
+			iph->id = htons(id);
+			if (!(gso_type & SKB_GSO_TCP_FIXEDID))
+				id++;
+			ip_send_check(iph);
+			th->check = ~tcp_v4_check(tcplen, iph->saddr, iph->daddr, 0);
+		} else {
+			ip6h->payload_len = htons(hdr_len - nh_off - sizeof(*ip6h) + seglen);
+			th->check = ~tcp_v6_check(tcplen, &ip6h->saddr, &ip6h->daddr, 0);
+		}
+
+		f.head = hdr;
+		f.head_len = hdr_len;
+		f.skb = skb;
+		f.off = off;
+		f.len = seglen;
+		f.csum_start = th_off;
+		f.csum_offset = offsetof(struct tcphdr, check);
+		f.sent_ns = SNULL_SKB_CB(skb)->sent_ns;
+		snull_hw_tx_frame(q, &f);
+	}
+}
+
+/*
+ * Transmit a packet (low level interface): fetch the skb and segment
+ * it if it is a TSO one.
+ */
+static void snull_hw_tx(struct snull_queue *q, struct sk_buff *skb)
+{
+	char shortpkt[ETH_ZLEN];
+	struct snull_frame f;
+
+	trace_snull_hw_tx(q->dev, q->index, skb);
+	if (skb_is_gso(skb)) {
+		snull_hw_tso(q, skb);
+	} else {
+		if (skb->len < ETH_ZLEN) {
+			/* pad it, as the hardware would */
+			memset(shortpkt, 0, ETH_ZLEN);
+			skb_copy_bits(skb, 0, shortpkt, skb->len);
+			snull_frame_init(&f, shortpkt, ETH_ZLEN);
+		} else {
+			/* scatter-gather: the frags come along in the copy */
+			snull_frame_init(&f, skb->data, skb_headlen(skb));
+			f.skb = skb;
+			f.off = skb_headlen(skb);
+			f.len = skb->len - skb_headlen(skb);
+		}
+		if (skb->ip_summed == CHECKSUM_PARTIAL) {
+			f.csum_start = skb_checksum_start_offset(skb);
+			f.csum_offset = skb->csum_offset;
+		}
+		f.sent_ns = SNULL_SKB_CB(skb)->sent_ns;
+		snull_hw_tx_frame(q, &f);
+	}
+}
+
+/*
+ * Ring the doorbell: hand every skb posted since the last kick over to
+ * the TX engine, and make sure it runs. That's all the sender does;
+ * the engine puts them on the wire later, from its own NAPI context.
+ * Called with the TX queue lock held.
+ */
+static void snull_tx_kick(struct snull_queue *q)
+{
+	struct snull_ring *ring = &q->pool;
+
+	if (ring->tx_tail == ring->tx_prod)
+		return;
+	/* Pairs with the acquire in snull_tx_poll() */
+	smp_store_release(&ring->tx_tail, ring->tx_prod);
+	q->tx_kicks++;
+	napi_schedule(&q->tx_napi);
+}
+
+/*
+ * The TX engine, a TX-only NAPI instance per queue standing in for
+ * the DMA engine of a NIC: fetch up to 'budget' of the skbs rung for,
+ * put them on the wire, and signal the transmission done once for the
+ * lot. The copy into the receiver and whatever the receive interrupt
+ * does then run here, not on the sender's stack; with threaded NAPI,
+ * not even on its CPU.
+ *
+ * Every frame on the wire takes a descriptor, so a TSO skb needs one
+ * per segment. When they are short, the engine waits for the receive
+ * side to give some back (snull_release_buffer()), and the TX ring
+ * backs up meanwhile. The descriptors are shared with XDP, hence the
+ * TX queue lock.
+ */
+static int snull_tx_poll(struct napi_struct *napi, int budget)
+{
+	struct snull_queue *q = container_of(napi, struct snull_queue, tx_napi);
+	struct netdev_queue *txq = netdev_get_tx_queue(q->dev, q->index);
+	struct skb_shared_hwtstamps hwts = {};
+	struct snull_ring *ring = &q->pool;
+	unsigned int head, tail, needed;
+	struct sk_buff *skb;
+	bool lost = false;
+	int work = 0;
+
+	__netif_tx_lock(txq, smp_processor_id());
+	head = ring->tx_fetched;
+	/* Pairs with the release in snull_tx_kick() */
+	tail = smp_load_acquire(&ring->tx_tail);
+	while (head != tail && work < budget) {
+		skb = ring->tx_skbs[head & ring->mask];
+		needed = skb_is_gso(skb) ? skb_shinfo(skb)->gso_segs : 1;
+		if (unlikely(snull_pool_avail(ring) < needed)) {
+			WRITE_ONCE(ring->stalled, true);
+			/* Pairs with the barrier in snull_release_buffer() */
+			smp_mb();
+			if (snull_pool_avail(ring) < needed) {
+				q->stats.tx_stalls++;
+				break;
+			}
+			WRITE_ONCE(ring->stalled, false);
+		}
+		/* The TX timestamp: the frame goes on the wire */
+		if (unlikely(skb_shinfo(skb)->tx_flags & SKBTX_IN_PROGRESS)) {
+			hwts.hwtstamp = ktime_get_real();
+			snull_hw_tx(q, skb);
+			skb_tstamp_tx(skb, &hwts);
+		} else {
+			snull_hw_tx(q, skb);
+		}
+		head++;
+		work++;
+	}
+	/*
+	 * Publish them to the TX-done side; pairs with snull_tx_clean().
+	 * The skbs are only freed from there, so none goes while still
+	 * being read.
+	 */
+	smp_store_release(&ring->tx_fetched, head);
+
+	if (work && lockup && (++q->tx_batches % lockup) == 0) {
+        	/* Simulate a dropped transmit interrupt */
+		snull_tx_kick(q);	/* a stopped queue has nothing waiting */
+		netif_stop_subqueue(q->dev, q->index);
+		PDEBUG("Simulate lockup at %ld, txp %lu\n", jiffies,
+				q->tx_batches);
+		lost = true;
+	}
+	__netif_tx_unlock(txq);
+
+	if (work && !lost)
+		snull_signal(q, SNULL_TX_INTR); // simulate Tx done interrupt
+
+	/* More rung for than the budget: the core will call us again */
+	if (work == budget)
+		return budget;
+	/* A doorbell rung meanwhile found us scheduled: we run again */
+	napi_complete_done(napi, work);
+	return work;
+}
+
+/*
+ * Transmit a packet (called by the kernel)
+ */
+static netdev_tx_t snull_tx(struct sk_buff *skb, struct net_device *dev)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	u16 qidx = skb_get_queue_mapping(skb);
+	struct snull_queue *q = &priv->queues[qidx];
+	struct snull_ring *ring = &q->pool;
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, qidx);
+
+	trace_snull_xmit(dev, qidx, skb);
+
+	/* The queue is stopped as the TX ring fills, so this is rare */
+	if (unlikely(snull_maybe_stop_tx(q)))
+		return NETDEV_TX_BUSY;
+
+	SNULL_SKB_CB(skb)->sent_ns = snull_lat_stamp();
+
+	/* save the timestamp */
+	txq_trans_cond_update(txq);
+
+	/* A hardware TX timestamp is taken at the wire (snull_tx_poll) */
+	if (unlikely(skb_shinfo(skb)->tx_flags & SKBTX_HW_TSTAMP) &&
+	    READ_ONCE(priv->hwts.tx_type) == HWTSTAMP_TX_ON)
+		skb_shinfo(skb)->tx_flags |= SKBTX_IN_PROGRESS;
+	skb_tx_timestamp(skb);
+
+	/*
+	 * Post the skb on the TX ring, and only ring the doorbell when the
+	 * stack has no more for us right now (or BQL stopped the queue, so
+	 * no more will come), or when the ring is full: it is stopped
+	 * then, and a stopped queue must have nothing waiting.
+	 */
+	ring->tx_skbs[ring->tx_prod & ring->mask] = skb;
+	WRITE_ONCE(ring->tx_prod, ring->tx_prod + 1);
+	if (__netdev_tx_sent_queue(txq, skb->len, netdev_xmit_more()) ||
+	    !snull_tx_room(ring)) {
+		snull_tx_kick(q);
+		snull_maybe_stop_tx(q);
+	}
+
+	return NETDEV_TX_OK; /* Our simple device can not fail */
+}
+
+/*
+ * Deal with a transmit timeout.
+ */
+static void snull_tx_timeout (struct net_device *dev, unsigned int txqueue)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q = &priv->queues[txqueue];
+	unsigned long flags;
+
+	PDEBUG("Transmit timeout on queue %u at %ld, latency %ld\n", txqueue,
+			jiffies, jiffies - netdev_get_tx_queue(dev, txqueue)->trans_start);
+        /* Simulate a transmission interrupt to get things moving */
+	snull_tx_kick(q);	/* the watchdog holds the TX lock */
+	spin_lock_irqsave(&q->lock, flags);
+	q->status |= SNULL_TX_INTR;
+	spin_unlock_irqrestore(&q->lock, flags);
+	snull_interrupt(txqueue, q);
+	snull_stats_inc(priv, tx_errors);
+	netif_wake_subqueue(dev, txqueue);
+	return;
+}
+
+
+
+/*
+ * Ioctl commands: hardware timestamping. Any RX filter but "none"
+ * timestamps every frame, which the API allows.
+ */
+static int snull_hwtstamp_set(struct net_device *dev, struct ifreq *rq)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct hwtstamp_config config;
+	unsigned long flags;
+
+	if (copy_from_user(&config, rq->ifr_data, sizeof(config)))
+		return -EFAULT;
+	switch (config.tx_type) {
+	case HWTSTAMP_TX_OFF:
+	case HWTSTAMP_TX_ON:
+		break;
+	default:
+		return -ERANGE;
+	}
+	if (config.rx_filter != HWTSTAMP_FILTER_NONE)
+		config.rx_filter = HWTSTAMP_FILTER_ALL;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	WRITE_ONCE(priv->hwts.tx_type, config.tx_type);
+	WRITE_ONCE(priv->hwts.rx_filter, config.rx_filter);
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	return copy_to_user(rq->ifr_data, &config, sizeof(config)) ? -EFAULT : 0;
+}
+
+static int snull_hwtstamp_get(struct net_device *dev, struct ifreq *rq)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct hwtstamp_config config;
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	config = priv->hwts;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	return copy_to_user(rq->ifr_data, &config, sizeof(config)) ? -EFAULT : 0;
+}
+
+static int snull_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
+{
+	PDEBUGG("ioctl\n");
+	switch (cmd) {
+	case SIOCSHWTSTAMP:
+		return snull_hwtstamp_set(dev, rq);
+	case SIOCGHWTSTAMP:
+		return snull_hwtstamp_get(dev, rq);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+/*
+ * Return statistics to the caller: the sum over all CPUs
+ */
+static void snull_get_stats64(struct net_device *dev, struct rtnl_link_stats64 *stats)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	u64 rx_packets, rx_bytes, rx_dropped, tx_packets, tx_bytes, tx_dropped, tx_errors;
+	unsigned int start;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		const struct snull_pcpu_stats *st = per_cpu_ptr(priv->pcpu_stats, cpu);
+
+		do {
+			start = u64_stats_fetch_begin(&st->syncp);
+			rx_packets = u64_stats_read(&st->rx_packets);
+			rx_bytes   = u64_stats_read(&st->rx_bytes);
+			rx_dropped = u64_stats_read(&st->rx_dropped);
+			tx_packets = u64_stats_read(&st->tx_packets);
+			tx_bytes   = u64_stats_read(&st->tx_bytes);
+			tx_dropped = u64_stats_read(&st->tx_dropped);
+			tx_errors  = u64_stats_read(&st->tx_errors);
+		} while (u64_stats_fetch_retry(&st->syncp, start));
+
+		stats->rx_packets += rx_packets;
+		stats->rx_bytes   += rx_bytes;
+		stats->rx_dropped += rx_dropped;
+		stats->tx_packets += tx_packets;
+		stats->tx_bytes   += tx_bytes;
+		stats->tx_dropped += tx_dropped;
+		stats->tx_errors  += tx_errors;
+	}
+}
+
+/*
+ * XDP: attach or detach a native XDP program. The program runs from
+ * NAPI poll, so native mode needs use_napi=1; the regular-interrupt
+ * mode is left to generic XDP.
+ */
+static int snull_xdp_setup(struct net_device *dev, struct bpf_prog *prog,
+		struct netlink_ext_ack *extack)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct bpf_prog *old;
+
+	if (prog && !use_napi) {
+		NL_SET_ERR_MSG_MOD(extack, "native XDP needs the module loaded with use_napi=1");
+		return -EOPNOTSUPP;
+	}
+	if (prog && dev->mtu > SNULL_XDP_MAX_MTU) {
+		NL_SET_ERR_MSG_MOD(extack, "MTU too large for XDP");
+		return -EINVAL;
+	}
+
+	old = rcu_replace_pointer(priv->xdp_prog, prog, lockdep_rtnl_is_held());
+	if (old)
+		bpf_prog_put(old);
+	return 0;
+}
+
+/*
+ * AF_XDP: bind (pool != NULL) or unbind a zero-copy socket on queue
+ * 'qid'. The queue is quiesced while its receive memory changes over;
+ * frames queued for it at that point are dropped.
+ */
+static int snull_xsk_pool_setup(struct net_device *dev,
+		struct xsk_buff_pool *pool, u16 qid)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	bool running = netif_running(dev);
+	struct xsk_buff_pool *old;
+	struct snull_queue *q;
+	unsigned long flags;
+	int err;
+
+	if (qid >= priv->num_queues)
+		return -EINVAL;
+	if (!use_napi)
+		return -EOPNOTSUPP;
+	q = &priv->queues[qid];
+
+	if (pool) {
+		err = xsk_pool_dma_map(pool, &snull_pdev->dev, 0);
+		if (err)
+			return err;
+	}
+
+	if (running) {
+		napi_disable(&q->napi);
+		xdp_rxq_info_unreg_mem_model(&q->xdp_rxq);
+	}
+	local_bh_disable();	/* see snull_release() */
+	spin_lock_irqsave(&q->lock, flags);
+	__snull_drain_rx(q);
+	snull_rx_ints(q, 1);
+	old = q->xsk_pool;
+	q->xsk_pool = pool;
+	spin_unlock_irqrestore(&q->lock, flags);
+	local_bh_enable();
+	if (running) {
+		err = snull_reg_rxq_mem(q);
+		if (err)
+			netdev_warn(dev, "queue %d: can't register XDP memory model (%d)\n",
+				    qid, err);
+		napi_enable(&q->napi);
+	}
+
+	if (old)
+		xsk_pool_dma_unmap(old, 0);
+	return 0;
+}
+
+/*
+ * AF_XDP: userspace has put descriptors on the fill or TX ring. NAPI
+ * poll is where both are processed, so just make sure it runs.
+ */
+static int snull_xsk_wakeup(struct net_device *dev, u32 qid, u32 flags)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+
+	if (!netif_running(dev))
+		return -ENETDOWN;
+	if (qid >= priv->num_queues)
+		return -EINVAL;
+	q = &priv->queues[qid];
+	if (!READ_ONCE(q->xsk_pool))
+		return -ENXIO;
+
+	if (!napi_if_scheduled_mark_missed(&q->napi)) {
+		local_bh_disable();
+		napi_schedule(&q->napi);
+		local_bh_enable();
+	}
+	return 0;
+}
+
+static int snull_bpf(struct net_device *dev, struct netdev_bpf *bpf)
+{
+	switch (bpf->command) {
+	case XDP_SETUP_PROG:
+		return snull_xdp_setup(dev, bpf->prog, bpf->extack);
+	case XDP_SETUP_XSK_POOL:
+		return snull_xsk_pool_setup(dev, bpf->xsk.pool, bpf->xsk.queue_id);
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * XDP_REDIRECT target: transmit frames redirected to us from another
+ * device (or from ourselves). Frames we don't send are freed by the
+ * caller; the ones we do send were copied onto the wire, so we give
+ * them back right away.
+ */
+static int snull_xdp_xmit(struct net_device *dev, int n,
+		struct xdp_frame **frames, u32 flags)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	void *data[XDP_BULK_QUEUE_SIZE];
+	u32 len[XDP_BULK_QUEUE_SIZE];
+	int i, nxmit;
+
+	if (unlikely(flags & ~XDP_XMIT_FLAGS_MASK))
+		return -EINVAL;
+	if (unlikely(!netif_running(dev)))
+		return -ENETDOWN;
+
+	n = min(n, XDP_BULK_QUEUE_SIZE);
+	for (i = 0; i < n; i++) {
+		data[i] = frames[i]->data;
+		len[i] = frames[i]->len;
+	}
+	nxmit = snull_xdp_xmit_frames(dev, smp_processor_id() % priv->num_queues,
+				      data, len, n);
+	for (i = 0; i < nxmit; i++)
+		xdp_return_frame(frames[i]);
+	return nxmit;
+}
+
+#if 0
+/*
+ * This function is called to fill up an eth header, since arp is not
+ * available on the interface
+ */
+int snull_rebuild_header(struct sk_buff *skb)
+{
+	struct ethhdr *eth = (struct ethhdr *) skb->data;
+	struct net_device *dev = skb->dev;
+    
+	memcpy(eth->h_source, dev->dev_addr, dev->addr_len);
+	memcpy(eth->h_dest, dev->dev_addr, dev->addr_len);
+	eth->h_dest[ETH_ALEN-1]   ^= 0x01;   /* dest is us xor 1 */
+	return 0;
+}
+
+
+int snull_header(struct sk_buff *skb, struct net_device *dev,
+                unsigned short type, void *daddr, void *saddr,
+                unsigned int len)
+{
+	struct ethhdr *eth = (struct ethhdr *)skb_push(skb,ETH_HLEN);
+
+	eth->h_proto = htons(type);
+	memcpy(eth->h_source, saddr ? saddr : dev->dev_addr, dev->addr_len);
+	memcpy(eth->h_dest,   daddr ? daddr : dev->dev_addr, dev->addr_len);
+	eth->h_dest[ETH_ALEN-1]   ^= 0x01;   /* dest is us xor 1 */
+	return (dev->hard_header_len);
+}
+#endif
+
+
+
+
+/*
+ * The "change_mtu" method is usually not needed.
+ * If you need it, it must be like this.
+ */
+static int snull_change_mtu(struct net_device *dev, int new_mtu)
+{
+	unsigned long flags;
+	struct snull_priv *priv = netdev_priv(dev);
+	spinlock_t *lock = &priv->lock;
+    
+	/*
+	 * The core checked the range against min_mtu/max_mtu, and the
+	 * receive pages were sized for max_mtu; only XDP has a lower limit.
+	 */
+	if (rcu_access_pointer(priv->xdp_prog) && new_mtu > SNULL_XDP_MAX_MTU)
+		return -EINVAL;
+	/*
+	 * Do anything you need, and the accept the value
+	 */
+	spin_lock_irqsave(lock, flags);
+	dev->mtu = new_mtu;
+	spin_unlock_irqrestore(lock, flags);
+	return 0; /* success */
+}
+
+/*
+ * ethtool -c/-C: interrupt moderation. rx/tx-usecs is how long an
+ * event may wait for company, rx/tx-frames how many may pile up (0
+ * for no limit); adaptive-rx/tx lets the delay follow the load.
+ */
+static int snull_get_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+		struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	ec->rx_coalesce_usecs = priv->rx_coal.usecs;
+	ec->rx_max_coalesced_frames = priv->rx_coal.max_frames;
+	ec->use_adaptive_rx_coalesce = priv->rx_coal.adaptive;
+	ec->tx_coalesce_usecs = priv->tx_coal.usecs;
+	ec->tx_max_coalesced_frames = priv->tx_coal.max_frames;
+	ec->use_adaptive_tx_coalesce = priv->tx_coal.adaptive;
+	return 0;
+}
+
+/* The delay a queue starts out with; adaptive mode needs a non-zero one */
+static u32 snull_coal_start_usecs(const struct snull_coal *coal)
+{
+	if (!coal->adaptive)
+		return coal->usecs;
+	return clamp_t(u32, coal->usecs, SNULL_COAL_ADAPT_MIN_USECS,
+		       SNULL_COAL_ADAPT_MAX_USECS);
+}
+
+static int snull_set_coalesce(struct net_device *dev, struct ethtool_coalesce *ec,
+		struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+	unsigned long flags;
+	int i;
+
+	if (ec->rx_coalesce_usecs > SNULL_COAL_MAX_USECS ||
+	    ec->tx_coalesce_usecs > SNULL_COAL_MAX_USECS) {
+		NL_SET_ERR_MSG_MOD(extack, "coalescing delay too long");
+		return -EINVAL;
+	}
+
+	spin_lock_irqsave(&priv->lock, flags);
+	priv->rx_coal.usecs = ec->rx_coalesce_usecs;
+	priv->rx_coal.max_frames = ec->rx_max_coalesced_frames;
+	priv->rx_coal.adaptive = ec->use_adaptive_rx_coalesce;
+	priv->tx_coal.usecs = ec->tx_coalesce_usecs;
+	priv->tx_coal.max_frames = ec->tx_max_coalesced_frames;
+	priv->tx_coal.adaptive = ec->use_adaptive_tx_coalesce;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	/* Restart every queue from the new settings */
+	for (i = 0; i < priv->max_queues; i++) {
+		q = &priv->queues[i];
+		spin_lock_irqsave(&q->lock, flags);
+		q->rx_coal.usecs = snull_coal_start_usecs(&priv->rx_coal);
+		q->tx_coal.usecs = snull_coal_start_usecs(&priv->tx_coal);
+		spin_unlock_irqrestore(&q->lock, flags);
+	}
+	return 0;
+}
+
+/*
+ * Per-queue counters (ethtool -S), for the queues in use. The TX and
+ * RX halves of queue pair N are reported together as qN_*.
+ */
+static const char snull_queue_stat_names[][ETH_GSTRING_LEN] = {
+	"tx_pool_empty",
+	"tx_doorbells",
+	"tx_engine_stalls",
+	"rx_drops",
+	"interrupts",
+	"napi_polls",
+	"napi_budget_exhausted",
+};
+#define SNULL_QUEUE_STATS	ARRAY_SIZE(snull_queue_stat_names)
+
+static int snull_get_sset_count(struct net_device *dev, int sset)
+{
+	struct snull_priv *priv = netdev_priv(dev);
 
-	/*
-	 * As usual, check the "device" pointer for shared handlers.
-	 * Then assign "struct device *dev"
-	 */
-	struct net_device *dev = (struct net_device *)dev_id;
-	/* ... and check with hw if it's really ours */
+	if (sset != ETH_SS_STATS)
+		return -EOPNOTSUPP;
+	return priv->num_queues * SNULL_QUEUE_STATS;
+}
 
-QP;
-	/* paranoid */
-	if (!dev)
+static void snull_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int i, j;
+
+	if (sset != ETH_SS_STATS)
 		return;
+	for (i = 0; i < priv->num_queues; i++)
+		for (j = 0; j < SNULL_QUEUE_STATS; j++)
+			ethtool_sprintf(&data, "q%d_%s", i, snull_queue_stat_names[j]);
+}
 
-	/* Lock the device */
-	priv = netdev_priv(dev);
-	spin_lock(&priv->lock);
+static void snull_get_ethtool_stats(struct net_device *dev,
+		struct ethtool_stats *stats, u64 *data)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_queue *q;
+	int i;
 
-	/* retrieve statusword: real netdevices use I/O instructions */
-	statusword = priv->status;
-	priv->status = 0;
-	if (statusword & SNULL_RX_INTR) {
-		snull_rx_ints(dev, 0);  /* Disable further interrupts */
-		// Turn on (NAPI) polling...
-//		netif_rx_schedule(dev, priv->pstNapi); // ??
-	}
-	if (statusword & SNULL_TX_INTR) {
-        	/* a transmission is over: free the skb */
-		priv->stats.tx_packets++;
-		priv->stats.tx_bytes += priv->tx_packetlen;
-		dev_kfree_skb(priv->skb);
+	for (i = 0; i < priv->num_queues; i++) {
+		q = &priv->queues[i];
+		*data++ = READ_ONCE(q->stats.pool_empty);
+		*data++ = READ_ONCE(q->tx_kicks);
+		*data++ = READ_ONCE(q->stats.tx_stalls);
+		*data++ = READ_ONCE(q->stats.rx_drops);
+		*data++ = READ_ONCE(q->stats.interrupts);
+		*data++ = READ_ONCE(q->stats.napi_polls);
+		*data++ = READ_ONCE(q->stats.budget_exhausted);
 	}
-
-	/* Unlock the device and we are done */
-	spin_unlock(&priv->lock);
-	return;
 }
 
-
 /*
- * Transmit a packet (low level interface).
- *
- * This function deals with hw details. This interface loops
- * back the packet to the other snull interface (if any).
- * In other words, this function implements the snull behaviour,
- * while all other procedures are rather device-independent.
+ * Resize the rings (ethtool -G) or change the number of queues in use
+ * (ethtool -L). Like a NIC, the device is stopped for that: nothing
+ * transmits, and the wire drops whatever is sent to us. Frames sent
+ * before may still sit on a peer's receive list, holding descriptors
+ * of the old ring, so give them a moment to come home. Then the rings
+ * and page pools are replaced, and the device started again. Called
+ * under RTNL.
  */
-static void snull_hw_tx(char *buf, int len, struct net_device *dev)
+static int snull_reconfigure(struct net_device *dev, unsigned int size,
+		unsigned int nq)
 {
-	struct iphdr *ih;
-	struct net_device *dest;
-	struct snull_priv *priv;
-	u32 *saddr, *daddr;
-	struct snull_packet *tx_buffer;
-	u8 prot = 0xff; //buf[14+20]; // first byte after the Eth and IP headers is the protocol type
-    
-	/* I am paranoid. Ain't I? */
-	if (len < sizeof(struct ethhdr) + sizeof(struct iphdr)) {
-		printk("%s: Hmm... packet too short (%i octets)\n",
-				DRVNAME, len);
-		return;
-	}
-
-#if 0
-    //  void print_hex_dump_bytes(const char *prefix_str, int prefix_type, const void *buf, size_t len)
-	print_hex_dump_bytes ("", DUMP_PREFIX_OFFSET, buf, len);
-#endif
+	struct snull_priv *priv = netdev_priv(dev);
+	unsigned int cur = priv->queues[0].pool.size;
+	bool running = netif_running(dev);
+	unsigned long deadline = jiffies + HZ;
+	struct snull_queue *q;
+	unsigned long flags;
+	int i, err = 0;
 
-	if (0) { /* enable this conditional to look at the data */
-		int i;
-		PDEBUG("len is %i\n" KERN_DEBUG "data:",len);
-		for (i=14 ; i<len; i++) {
-			printk(" %02x",buf[i]&0xff);
-			if (i == 19) printk("\n");
-			if (i == (19+8)) printk("\n"); // ping case: ICMP metadata is 8 octets
-		}
-		printk("\n");
+	if (running) {
+		/*
+		 * Detached, the watchdog leaves the stopped queues alone.
+		 * Taking the TX locks waits out senders, XDP ones included,
+		 * that came before 'down' was set.
+		 */
+		WRITE_ONCE(priv->down, true);
+		netif_device_detach(dev);
+		netif_tx_disable(dev);
+		snull_release(dev);
 	}
-	/*
-	 * Ethhdr is 14 bytes, but the kernel arranges for iphdr
-	 * to be aligned (i.e., ethhdr is unaligned)
-	 */
-	ih = (struct iphdr *)(buf+sizeof(struct ethhdr));
-	saddr = &ih->saddr;
-	daddr = &ih->daddr;
-
-	MSG("len is %d octets.\n", len);
-	// Is this really an ICMP packet?
-	// [??] byte following ICMP protocol Type is Code which should be 0 [??]
-	if ((buf[14+20] == ICMP_ECHO) && (buf[14+20+1] == 0x0))
-		prot = ICMP_ECHO;
-	else if ((buf[14+20] == ICMP_ECHOREPLY) && (buf[14+20+1] == 0x0))
-		prot = ICMP_ECHOREPLY;
-
-	/* 
-	 * We're skipping the LDD3-work of toggling the third octet in this ver;
-	 * we're only really concerned with getting the 'ping' semantics working right. 
-	 */
-	if ((prot != ICMP_ECHO) && (prot != ICMP_ECHOREPLY)) { // not an ICMP echo (ping) request/reply
-#if 0
-		((u8 *)saddr)[2] ^= 1; /* change the third octet (class C) */
-		((u8 *)daddr)[2] ^= 1;
-#endif
-		MSG("NOT an ICMP packet; arranging for Rx on twin device...\n");
-	} else { // we're in a 'ping'-driven Tx
-		u32 tmp = ih->saddr;
-		if (prot == ICMP_ECHO)
-			MSG("Tx:[ping] ICMP ECHO request packet\n");
-		else if (prot == ICMP_ECHOREPLY)
-			MSG("Tx:[ping] ICMP ECHOREPLY reply packet\n");
-
-		// Interchange Src & Dest IP addresses
-		ih->saddr = ih->daddr;
-		ih->daddr = tmp;
-		//MSG("src=%08x dest=%08x\n", ntohl(ih->saddr), ntohl(ih->daddr));
-
-		// Set ICMP identifier, byte[x26,x27]
-		buf[0x26] -= 0x8;
-	}
-
-	ih->check = 0;         /* and rebuild the checksum (ip needs it) */
-	ih->check = ip_fast_csum((unsigned char *)ih,ih->ihl);
-
-	if (dev == snull_devs[0])
-		PDEBUG("%08x:%05i --> %08x:%05i\n",
-				ntohl(ih->saddr),ntohs(((struct tcphdr *)(ih+1))->source),
-				ntohl(ih->daddr),ntohs(((struct tcphdr *)(ih+1))->dest));
-	else
-		PDEBUG("%08x:%05i <-- %08x:%05i\n",
-				ntohl(ih->daddr),ntohs(((struct tcphdr *)(ih+1))->dest),
-				ntohl(ih->saddr),ntohs(((struct tcphdr *)(ih+1))->source));
 
 	/*
-	 * Ok, now the packet is ready for transmission: first simulate a
-	 * receive interrupt on the twin device, then a transmission-done on 
-     * the transmitting device.
+	 * A peer may have steered a frame to a queue going out of use just
+	 * before we went down: empty them all, their NAPI won't run again.
+	 * snull_wire_deliver() keeps them empty from here on. Then wait for
+	 * every ring's descriptors, the unused queues' included.
 	 */
-	if ((prot == ICMP_ECHO) || (prot == ICMP_ECHOREPLY)) // an ICMP echo (ping) request/reply
-		dest = snull_devs[dev == snull_devs[0] ? 0 : 1]; // Rx intr on same interface
-	else
-		dest = snull_devs[dev == snull_devs[0] ? 1 : 0]; // Rx intr on twin interface
+	for (i = nq; i < priv->max_queues; i++) {
+		q = &priv->queues[i];
+		local_bh_disable();	/* see snull_release() */
+		spin_lock_irqsave(&q->lock, flags);
+		__snull_drain_rx(q);
+		spin_unlock_irqrestore(&q->lock, flags);
+		local_bh_enable();
+	}
+	for (i = 0; i < priv->max_queues; i++) {
+		q = &priv->queues[i];
+		while (snull_pool_avail(&q->pool) != q->pool.size) {
+			if (time_after(jiffies, deadline)) {
+				netdev_warn(dev, "queue %d: descriptors still out, try again\n", i);
+				err = -EBUSY;
+				goto out;
+			}
+			msleep(1);
+		}
+	}
 
-	priv = netdev_priv(dest);
-	tx_buffer = snull_get_tx_buffer(dev);
-	tx_buffer->datalen = len;
-	memcpy(tx_buffer->data, buf, len);
-	snull_enqueue_buf(dest, tx_buffer);
-	if (priv->rx_int_enabled) {
-		priv->status |= SNULL_RX_INTR;
-		MSG("Simulating Rx interrupt now...\n");
-		snull_interrupt(0, dest); // simulate Rx interrupt
+	if (size != cur) {
+		for (i = 0; i < priv->max_queues && !err; i++) {
+			q = &priv->queues[i];
+			err = snull_setup_pool(q, size);
+			if (!err)
+				err = snull_setup_page_pool(q);
+		}
+		/* A failure leaves some queues at the old size: go by the smaller */
+		netif_set_tso_max_segs(dev, max((err ? min(size, cur) : size) / 2, 1U));
+		if (err)
+			goto out;
 	}
 
-	priv = netdev_priv(dev);
-	priv->tx_packetlen = len;
-	priv->tx_packetdata = buf;
-	priv->status |= SNULL_TX_INTR;
-	if (lockup && ((priv->stats.tx_packets + 1) % lockup) == 0) {
-        	/* Simulate a dropped transmit interrupt */
-		netif_stop_queue(dev);
-		PDEBUG("Simulate lockup at %ld, txp %ld\n", jiffies,
-				(unsigned long) priv->stats.tx_packets);
+	if (nq != priv->num_queues) {
+		err = netif_set_real_num_queues(dev, nq, nq);
+		if (err)
+			goto out;
+		WRITE_ONCE(priv->num_queues, nq);
+		/* A table the user didn't set follows the queue count */
+		if (!netif_is_rxfh_configured(dev))
+			for (i = 0; i < SNULL_RSS_INDIR_SIZE; i++)
+				WRITE_ONCE(priv->rss_indir[i],
+					   ethtool_rxfh_indir_default(i, nq));
 	}
-	else {
-		MSG("Simulating Tx done interrupt now...\n");
-		snull_interrupt(0, dev); // simulate Tx done interrupt
-	//	dump_stack();
+
+  out:
+	if (running) {
+		i = snull_open(dev);
+		err = err ?: i;
+		netif_device_attach(dev);
 	}
+	return err;
+}
+
+static void snull_get_ringparam(struct net_device *dev, struct ethtool_ringparam *ring,
+		struct kernel_ethtool_ringparam *kring, struct netlink_ext_ack *extack)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	ring->rx_max_pending = ring->tx_max_pending = SNULL_MAX_POOL_SIZE;
+	ring->rx_pending = ring->tx_pending = priv->queues[0].pool.size;
 }
 
 /*
- * Transmit a packet (called by the kernel)
+ * A queue pair has one descriptor ring, sized like its page pool, so
+ * RX and TX sizes are one and the same: take whichever was changed.
  */
-static int snull_tx(struct sk_buff *skb, struct net_device *dev)
+static int snull_set_ringparam(struct net_device *dev, struct ethtool_ringparam *ring,
+		struct kernel_ethtool_ringparam *kring, struct netlink_ext_ack *extack)
 {
-	int len;
-	char *data, shortpkt[ETH_ZLEN];
 	struct snull_priv *priv = netdev_priv(dev);
-	unsigned long flags;
+	unsigned int cur = priv->queues[0].pool.size, size;
 
-#ifdef SNULL_DEBUG
-	printk("\n--------------------------------------------------------------\n");
-#endif
-QP;
-	data = skb->data;
-	len = skb->len;
-	if (len < ETH_ZLEN) {
-		memset(shortpkt, 0, ETH_ZLEN);
-		memcpy(shortpkt, skb->data, skb->len);
-		len = ETH_ZLEN;
-		data = shortpkt;
-	}
-	dev->trans_start = jiffies; /* save the timestamp */
-
-	/* Remember the skb, so we can free it at interrupt time */
-	spin_lock_irqsave(&priv->lock, flags);
-	priv->skb = skb;
-	spin_unlock_irqrestore(&priv->lock, flags);
+	if (ring->rx_pending != cur && ring->tx_pending != cur &&
+	    ring->rx_pending != ring->tx_pending) {
+		NL_SET_ERR_MSG_MOD(extack, "RX and TX share one ring per queue");
+		return -EINVAL;
+	}
+	size = ring->tx_pending != cur ? ring->tx_pending : ring->rx_pending;
+	size = roundup_pow_of_two(clamp(size, 2U, (unsigned int)SNULL_MAX_POOL_SIZE));
+	if (size == cur)
+		return 0;
+	return snull_reconfigure(dev, size, priv->num_queues);
+}
 
-	/* actual deliver of data is device-specific, and not shown here */
-	snull_hw_tx(data, len, dev);
+static void snull_get_channels(struct net_device *dev, struct ethtool_channels *ch)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	ch->max_combined = priv->max_queues;
+	ch->combined_count = priv->num_queues;
+}
 
-	return 0; /* Our simple device can not fail */
+/* The core checked the count against max_combined, and RSS and AF_XDP use */
+static int snull_set_channels(struct net_device *dev, struct ethtool_channels *ch)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+
+	if (!ch->combined_count || ch->rx_count || ch->tx_count)
+		return -EINVAL;
+	if (ch->combined_count == priv->num_queues)
+		return 0;
+	return snull_reconfigure(dev, priv->queues[0].pool.size, ch->combined_count);
 }
 
 /*
- * Deal with a transmit timeout.
+ * RSS (ethtool -x/-X). The core checks indirection table entries
+ * against the ring count that snull_get_rxnfc() reports.
  */
-static void snull_tx_timeout (struct net_device *dev)
+static int snull_get_rxnfc(struct net_device *dev, struct ethtool_rxnfc *info,
+		u32 *rule_locs)
 {
 	struct snull_priv *priv = netdev_priv(dev);
 
-	PDEBUG("Transmit timeout at %ld, latency %ld\n", jiffies,
-			jiffies - dev->trans_start);
-        /* Simulate a transmission interrupt to get things moving */
-	priv->status = SNULL_TX_INTR;
-	snull_interrupt(0, dev);
-	priv->stats.tx_errors++;
-	netif_wake_queue(dev);
-	return;
+	if (info->cmd != ETHTOOL_GRXRINGS)
+		return -EOPNOTSUPP;
+	info->data = priv->num_queues;
+	return 0;
 }
 
+static u32 snull_get_rxfh_key_size(struct net_device *dev)
+{
+	return SNULL_RSS_KEY_SIZE;
+}
 
+static u32 snull_get_rxfh_indir_size(struct net_device *dev)
+{
+	return SNULL_RSS_INDIR_SIZE;
+}
 
-/*
- * Ioctl commands 
- */
-static int snull_ioctl(struct net_device *dev, struct ifreq *rq, int cmd)
+static int snull_get_rxfh(struct net_device *dev, u32 *indir, u8 *key, u8 *hfunc)
 {
-	PDEBUGG("ioctl\n");
+	struct snull_priv *priv = netdev_priv(dev);
+
+	if (hfunc)
+		*hfunc = ETH_RSS_HASH_TOP;
+	if (indir)
+		memcpy(indir, priv->rss_indir, sizeof(priv->rss_indir));
+	if (key)
+		memcpy(key, priv->rss_key, sizeof(priv->rss_key));
+	return 0;
+}
+
+static int snull_set_rxfh(struct net_device *dev, const u32 *indir,
+		const u8 *key, const u8 hfunc)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	int i;
+
+	if (hfunc != ETH_RSS_HASH_NO_CHANGE && hfunc != ETH_RSS_HASH_TOP)
+		return -EOPNOTSUPP;
+	if (indir)
+		for (i = 0; i < SNULL_RSS_INDIR_SIZE; i++)
+			WRITE_ONCE(priv->rss_indir[i], indir[i]);
+	if (key)
+		memcpy(priv->rss_key, key, sizeof(priv->rss_key));
 	return 0;
 }
 
 /*
- * Return statistics to the caller
+ * Timestamping capabilities. The "hardware clock" is CLOCK_REALTIME,
+ * so there is no PHC to go with it.
  */
-static struct net_device_stats *snull_stats(struct net_device *dev)
+static int snull_get_ts_info(struct net_device *dev, struct ethtool_ts_info *info)
 {
-	struct snull_priv *priv = netdev_priv(dev);
-	return &priv->stats;
+	info->so_timestamping = SOF_TIMESTAMPING_TX_SOFTWARE |
+				SOF_TIMESTAMPING_RX_SOFTWARE |
+				SOF_TIMESTAMPING_SOFTWARE |
+				SOF_TIMESTAMPING_TX_HARDWARE |
+				SOF_TIMESTAMPING_RX_HARDWARE |
+				SOF_TIMESTAMPING_RAW_HARDWARE;
+	info->phc_index = -1;
+	info->tx_types = BIT(HWTSTAMP_TX_OFF) | BIT(HWTSTAMP_TX_ON);
+	info->rx_filters = BIT(HWTSTAMP_FILTER_NONE) | BIT(HWTSTAMP_FILTER_ALL);
+	return 0;
 }
 
-#if 0
+static const struct ethtool_ops snull_ethtool_ops = {
+	.supported_coalesce_params = ETHTOOL_COALESCE_USECS |
+				     ETHTOOL_COALESCE_MAX_FRAMES |
+				     ETHTOOL_COALESCE_USE_ADAPTIVE,
+	.get_link            = ethtool_op_get_link,
+	.get_sset_count      = snull_get_sset_count,
+	.get_strings         = snull_get_strings,
+	.get_ethtool_stats   = snull_get_ethtool_stats,
+	.get_ringparam       = snull_get_ringparam,
+	.set_ringparam       = snull_set_ringparam,
+	.get_channels        = snull_get_channels,
+	.set_channels        = snull_set_channels,
+	.get_coalesce        = snull_get_coalesce,
+	.set_coalesce        = snull_set_coalesce,
+	.get_rxnfc           = snull_get_rxnfc,
+	.get_rxfh_key_size   = snull_get_rxfh_key_size,
+	.get_rxfh_indir_size = snull_get_rxfh_indir_size,
+	.get_rxfh            = snull_get_rxfh,
+	.set_rxfh            = snull_set_rxfh,
+	.get_ts_info         = snull_get_ts_info,
+};
+
 /*
- * This function is called to fill up an eth header, since arp is not
- * available on the interface
+ * Link emulation settings, in /sys/class/net/snX/link/. The wheels are
+ * allocated on the first write, so a device nobody impairs pays nothing.
  */
-int snull_rebuild_header(struct sk_buff *skb)
+static int snull_wire_alloc(struct snull_priv *priv)
 {
-	struct ethhdr *eth = (struct ethhdr *) skb->data;
-	struct net_device *dev = skb->dev;
-    
-	memcpy(eth->h_source, dev->dev_addr, dev->addr_len);
-	memcpy(eth->h_dest, dev->dev_addr, dev->addr_len);
-	eth->h_dest[ETH_ALEN-1]   ^= 0x01;   /* dest is us xor 1 */
+	struct snull_wire *wire;
+	int i;
+
+	for (i = 0; i < priv->max_queues; i++) {
+		if (priv->queues[i].wire)
+			continue;
+		wire = kvzalloc(sizeof(*wire), GFP_KERNEL);
+		if (!wire)
+			return -ENOMEM;
+		wire->q = &priv->queues[i];
+		spin_lock_init(&wire->lock);
+		hrtimer_init(&wire->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+		wire->timer.function = snull_wire_timer;
+		/* Pairs with the acquire in snull_wire_xmit() */
+		smp_store_release(&priv->queues[i].wire, wire);
+	}
 	return 0;
 }
 
+static ssize_t snull_link_store(struct net_device *dev, u32 *field, u32 max,
+		const char *buf, size_t len)
+{
+	struct snull_priv *priv = netdev_priv(dev);
+	struct snull_link *link = &priv->link;
+	u32 val;
+	int err;
+
+	err = kstrtou32(buf, 0, &val);
+	if (err)
+		return err;
+	if (val > max)
+		return -EINVAL;
 
-int snull_header(struct sk_buff *skb, struct net_device *dev,
-                unsigned short type, void *daddr, void *saddr,
-                unsigned int len)
+	if (!rtnl_trylock())
+		return restart_syscall();
+	err = snull_wire_alloc(priv);
+	if (!err) {
+		WRITE_ONCE(*field, val);
+		WRITE_ONCE(link->active, link->rate_kbit || link->delay_us ||
+			   link->jitter_us || link->loss_ppm || link->ge_p_ppm ||
+			   link->reorder_ppm);
+	}
+	rtnl_unlock();
+	return err ?: len;
+}
+
+#define SNULL_LINK_ATTR(field, max)					\
+static ssize_t field##_show(struct device *d,				\
+		struct device_attribute *attr, char *buf)		\
+{									\
+	struct snull_priv *priv = netdev_priv(to_net_dev(d));		\
+									\
+	return sysfs_emit(buf, "%u\n", READ_ONCE(priv->link.field));	\
+}									\
+static ssize_t field##_store(struct device *d,				\
+		struct device_attribute *attr, const char *buf, size_t len) \
+{									\
+	struct snull_priv *priv = netdev_priv(to_net_dev(d));		\
+									\
+	return snull_link_store(to_net_dev(d), &priv->link.field, max, buf, len); \
+}									\
+static DEVICE_ATTR_RW(field)
+
+SNULL_LINK_ATTR(rate_kbit, U32_MAX);
+SNULL_LINK_ATTR(burst, U32_MAX);
+SNULL_LINK_ATTR(delay_us, SNULL_LINK_MAX_DELAY_US);
+SNULL_LINK_ATTR(jitter_us, SNULL_LINK_MAX_DELAY_US);
+SNULL_LINK_ATTR(loss_ppm, 1000000);
+SNULL_LINK_ATTR(ge_p_ppm, 1000000);
+SNULL_LINK_ATTR(ge_r_ppm, 1000000);
+SNULL_LINK_ATTR(ge_bad_loss_ppm, 1000000);
+SNULL_LINK_ATTR(reorder_ppm, 1000000);
+SNULL_LINK_ATTR(limit, SNULL_LINK_MAX_LIMIT);
+
+/* Frames the link lost, and frames dropped past the wheel or its limit */
+static ssize_t lost_show(struct device *d, struct device_attribute *attr, char *buf)
 {
-	struct ethhdr *eth = (struct ethhdr *)skb_push(skb,ETH_HLEN);
+	struct snull_priv *priv = netdev_priv(to_net_dev(d));
+	struct snull_wire *wire;
+	u64 sum = 0;
+	int i;
 
-	eth->h_proto = htons(type);
-	memcpy(eth->h_source, saddr ? saddr : dev->dev_addr, dev->addr_len);
-	memcpy(eth->h_dest,   daddr ? daddr : dev->dev_addr, dev->addr_len);
-	eth->h_dest[ETH_ALEN-1]   ^= 0x01;   /* dest is us xor 1 */
-	return (dev->hard_header_len);
+	for (i = 0; i < priv->max_queues; i++)
+		if ((wire = READ_ONCE(priv->queues[i].wire)))
+			sum += READ_ONCE(wire->lost);
+	return sysfs_emit(buf, "%llu\n", sum);
 }
-#endif
+static DEVICE_ATTR_RO(lost);
 
+static ssize_t overlimit_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct snull_priv *priv = netdev_priv(to_net_dev(d));
+	struct snull_wire *wire;
+	u64 sum = 0;
+	int i;
 
+	for (i = 0; i < priv->max_queues; i++)
+		if ((wire = READ_ONCE(priv->queues[i].wire)))
+			sum += READ_ONCE(wire->overlimit);
+	return sysfs_emit(buf, "%llu\n", sum);
+}
+static DEVICE_ATTR_RO(overlimit);
+
+static struct attribute *snull_link_attrs[] = {
+	&dev_attr_rate_kbit.attr,
+	&dev_attr_burst.attr,
+	&dev_attr_delay_us.attr,
+	&dev_attr_jitter_us.attr,
+	&dev_attr_loss_ppm.attr,
+	&dev_attr_ge_p_ppm.attr,
+	&dev_attr_ge_r_ppm.attr,
+	&dev_attr_ge_bad_loss_ppm.attr,
+	&dev_attr_reorder_ppm.attr,
+	&dev_attr_limit.attr,
+	&dev_attr_lost.attr,
+	&dev_attr_overlimit.attr,
+	NULL
+};
 
+static const struct attribute_group snull_link_group = {
+	.name  = "link",
+	.attrs = snull_link_attrs,
+};
 
 /*
- * The "change_mtu" method is usually not needed.
- * If you need it, it must be like this.
+ * Our TSO engine copies the headers to the stack; leave skbs with
+ * longer ones to software GSO.
  */
-static int snull_change_mtu(struct net_device *dev, int new_mtu)
+static netdev_features_t snull_features_check(struct sk_buff *skb,
+		struct net_device *dev, netdev_features_t features)
 {
-	unsigned long flags;
-	struct snull_priv *priv = netdev_priv(dev);
-	spinlock_t *lock = &priv->lock;
-    
-	/* check ranges */
-	if ((new_mtu < 68) || (new_mtu > 1500))
-		return -EINVAL;
-	/*
-	 * Do anything you need, and the accept the value
-	 */
-	spin_lock_irqsave(lock, flags);
-	dev->mtu = new_mtu;
-	spin_unlock_irqrestore(lock, flags);
-	return 0; /* success */
+	if (skb_is_gso(skb) && skb_tcp_all_headers(skb) > SNULL_TSO_MAX_HDR)
+		features &= ~NETIF_F_GSO_MASK;
+	return features;
 }
 
-
 static const struct net_device_ops snull_netdev_ops = {
 	.ndo_open            = snull_open,
 	.ndo_stop            = snull_release,
 	.ndo_set_config      = snull_config,
 	.ndo_start_xmit      = snull_tx,
-	.ndo_do_ioctl        = snull_ioctl,
-	.ndo_get_stats       = snull_stats,
+	.ndo_eth_ioctl       = snull_ioctl,
+	.ndo_get_stats64     = snull_get_stats64,
 	.ndo_change_mtu      = snull_change_mtu,  
+	.ndo_features_check  = snull_features_check,
 //	.ndo_rebuild_header  = snull_rebuild_header,
 //	.ndo_hard_header     = snull_header,
 	.ndo_tx_timeout      = snull_tx_timeout,
+	.ndo_bpf             = snull_bpf,
+	.ndo_xdp_xmit        = snull_xdp_xmit,
+	.ndo_xsk_wakeup      = snull_xsk_wakeup,
 };
 
 /*
@@ -769,6 +3423,8 @@ static const struct net_device_ops snull_netdev_ops = {
 static void snull_init(struct net_device *dev)
 {
 	struct snull_priv *priv;
+	struct snull_queue *q;
+	int i;
    	/*
 	 * Make the usual checks: check_region(), probe irq, ...  -ENODEV
 	 * should be returned if no device found.  No resource should be
@@ -782,84 +3438,514 @@ static void snull_init(struct net_device *dev)
 	ether_setup(dev); /* assign some of the fields */
 
 	dev->netdev_ops = &snull_netdev_ops;
+	dev->ethtool_ops = &snull_ethtool_ops;
+	dev->sysfs_groups[0] = &snull_link_group;
+	dev->xdp_features = NETDEV_XDP_ACT_NDO_XMIT;
+	if (use_napi)
+		dev->xdp_features |= NETDEV_XDP_ACT_BASIC | NETDEV_XDP_ACT_REDIRECT |
+				     NETDEV_XDP_ACT_XSK_ZEROCOPY;
 	dev->watchdog_timeo = timeout;
-	/* keep the default flags, just add NOARP */
-	dev->flags           |= IFF_NOARP;
-/* TODO : if ARP is overriden, we need the 'rebuild header' / 'snull_header' code to execute ?*/
-//	dev->features        |= NETIF_F_NO_CSUM;
+	dev->min_mtu = ETH_MIN_MTU;
+	dev->max_mtu = max_mtu;
+	/*
+	 * keep the default flags, just add NOARP; switch ports are hosts
+	 * on a LAN though, and need ARP to find each other
+	 */
+	if (!l2_switch)
+		dev->flags   |= IFF_NOARP;	/* snull_forward() addresses the peer */
+	/* Offloads, done in software by the "hardware" (snull_hw_tx) */
+	dev->hw_features      = NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_HIGHDMA |
+				NETIF_F_TSO | NETIF_F_TSO6 | NETIF_F_RXHASH;
+	dev->features        |= dev->hw_features;
 //	dev->hard_header_cache = NULL;      /* Disable caching */
 
 	/*
 	 * Then, initialize the priv field. This encloses the statistics
-	 * and a few private fields.
+	 * and a few private fields, followed by the queue pairs.
 	 */
 	priv = netdev_priv(dev);
-	memset(priv, 0, sizeof(struct snull_priv));
+	memset(priv, 0, struct_size(priv, queues, max_queues));
 	spin_lock_init(&priv->lock);
-	if (use_napi) {
-	/* The last param is 'budget': specifies how many packets the driver is allowed 
-	 to pass into the network stack on this call. There is no need to manage separate 
-	 quota fields anymore; drivers should simply respect budget and return the number 
-	 of packets which were actually processed. 
+	/* Checked by snull_init_module(): no device registers without them */
+	priv->pcpu_stats = netdev_alloc_pcpu_stats(struct snull_pcpu_stats);
+	/* No interrupt moderation to begin with: one interrupt per event */
+	priv->rx_coal.max_frames = 1;
+	priv->tx_coal.max_frames = 1;
+	/* A perfect link; once Gilbert-Elliott is on, its bad state loses all */
+	priv->link.ge_bad_loss_ppm = 1000000;
+	priv->link.limit = SNULL_LINK_LIMIT;
+	priv->down = true;
+	priv->num_queues = num_queues;
+	priv->max_queues = max_queues;
+	/* RSS: a random key, and flows spread evenly over the queues */
+	netdev_rss_key_fill(priv->rss_key, sizeof(priv->rss_key));
+	for (i = 0; i < SNULL_RSS_INDIR_SIZE; i++)
+		priv->rss_indir[i] = ethtool_rxfh_indir_default(i, priv->num_queues);
+	for (i = 0; i < priv->max_queues; i++) {
+		q = &priv->queues[i];
+		spin_lock_init(&q->lock);
+		q->dev = dev;
+		q->index = i;
+		/* Soft mode: the handlers expect to run in softirq context */
+		hrtimer_init(&q->coal_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+		q->coal_timer.function = snull_coal_timer;
+		if (use_napi) {
+	/* The core passes a 'budget' to the poll method: it specifies how many packets
+	 the driver is allowed to pass into the network stack on this call. There is no
+	 need to manage separate quota fields anymore; drivers should simply respect
+	 budget and return the number of packets which were actually processed.
+	 netif_napi_add() uses the default weight (NAPI_POLL_WEIGHT) as the budget.
 	 Source: 'Newer, newer NAPI' : http://lwn.net/Articles/244640/
 	*/
-		netif_napi_add (dev, priv->pstNapi, snull_poll, 2);
+			netif_napi_add (dev, &q->napi, snull_poll);
+		}
+		/* The TX engine is a NAPI instance in either mode */
+		netif_napi_add_tx(dev, &q->tx_napi, snull_tx_poll);
+		snull_rx_ints(q, 1);		/* enable receive interrupts */
+		if (!snull_setup_pool(q, pool_size))
+			snull_setup_page_pool(q);
 	}
-	snull_rx_ints(dev, 1);		/* enable receive interrupts */
-	snull_setup_pool(dev);
+	/* A TSO skb takes a descriptor per segment: half a ring, see pool_size */
+	netif_set_tso_max_segs(dev, max(priv->queues[0].pool.size / 2, 1U));
 }
 
 /*
  * The devices
  */
 
-struct net_device *snull_devs[2];
+struct net_device **snull_devs;
 
 /*
  * Finally, the module stuff
  */
 
-static void snull_cleanup(void)
+/*
+ * /sys/kernel/debug/snull/latency: the histogram summed over all CPUs,
+ * and the percentiles it gives (the upper edge of the bucket each one
+ * falls into, so they are good to a factor of two). Writing anything
+ * clears it.
+ */
+static u64 snull_lat_sum(u64 *count)
+{
+	u64 total = 0;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < SNULL_LAT_BUCKETS; i++)
+			count[i] += READ_ONCE(per_cpu(snull_lat, cpu).count[i]);
+	for (i = 0; i < SNULL_LAT_BUCKETS; i++)
+		total += count[i];
+	return total;
+}
+
+static void snull_lat_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&snull_lat, cpu), 0, sizeof(struct snull_lat_hist));
+}
+
+static u64 snull_lat_percentile(const u64 *count, u64 total, unsigned int permille)
+{
+	u64 seen = 0, rank = div_u64(total * permille + 999, 1000);
+	int i;
+
+	for (i = 0; i < SNULL_LAT_BUCKETS; i++) {
+		seen += count[i];
+		if (seen >= rank)
+			return i ? 1ULL << i : 0;
+	}
+	return 0;
+}
+
+static int snull_lat_show(struct seq_file *m, void *v)
 {
+	u64 count[SNULL_LAT_BUCKETS] = {};
+	u64 total = snull_lat_sum(count);
 	int i;
+
+	seq_printf(m, "samples: %llu\n", total);
+	if (!total)
+		return 0;
+	seq_printf(m, "p50_ns: %llu\n", snull_lat_percentile(count, total, 500));
+	seq_printf(m, "p99_ns: %llu\n", snull_lat_percentile(count, total, 990));
+	seq_printf(m, "p999_ns: %llu\n", snull_lat_percentile(count, total, 999));
+	for (i = 0; i < SNULL_LAT_BUCKETS; i++)
+		if (count[i])
+			seq_printf(m, "%12llu - %12llu ns: %llu\n",
+				   i ? 1ULL << (i - 1) : 0, (1ULL << i) - 1,
+				   count[i]);
+	return 0;
+}
+
+static int snull_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, snull_lat_show, NULL);
+}
+
+static ssize_t snull_lat_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	snull_lat_reset();
+	return count;
+}
+
+static const struct file_operations snull_lat_fops = {
+	.owner		= THIS_MODULE,
+	.open		= snull_lat_open,
+	.read		= seq_read,
+	.write		= snull_lat_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static DEFINE_MUTEX(snull_bench_mutex);
+
+/*
+ * One benchmark frame: UDP from 198.18.0.1 (the RFC 2544 range) to
+ * 198.18.0.2, port SNULL_BENCH_PORT, padded with zeroes to 'size'.
+ */
+static struct sk_buff *snull_bench_skb(struct net_device *dev,
+		struct net_device *sink, u16 sport, u16 qidx)
+{
+	unsigned int size = snull_bench.size;
+	struct sk_buff *skb;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	struct udphdr *uh;
+
+	skb = netdev_alloc_skb(dev, size);
+	if (!skb)
+		return NULL;
+	skb_reset_mac_header(skb);
+	skb_put_zero(skb, size);
+	eth = eth_hdr(skb);
+	ether_addr_copy(eth->h_dest, sink->dev_addr);
+	ether_addr_copy(eth->h_source, dev->dev_addr);
+	eth->h_proto = htons(ETH_P_IP);
+
+	skb_set_network_header(skb, ETH_HLEN);
+	iph = ip_hdr(skb);
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->tot_len = htons(size - ETH_HLEN);
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_UDP;
+	iph->saddr = htonl(0xc6120001);
+	iph->daddr = htonl(0xc6120002);
+	ip_send_check(iph);
+
+	skb_set_transport_header(skb, ETH_HLEN + sizeof(*iph));
+	uh = udp_hdr(skb);
+	uh->source = htons(sport);
+	uh->dest = htons(SNULL_BENCH_PORT);
+	uh->len = htons(size - ETH_HLEN - sizeof(*iph));	/* no checksum */
+
+	skb->protocol = eth->h_proto;
+	skb->dev = dev;
+	skb_set_queue_mapping(skb, qidx);
+	return skb;
+}
+
+/*
+ * Hand one frame to the driver straight, as pktgen does, with
+ * xmit_more set for all but the last of a burst. While the queue is
+ * stopped we retry, and give up only then if a signal comes: a
+ * stopped queue has nothing waiting for the doorbell (snull_tx()
+ * rings it before stopping), so the rest of the burst can go.
+ */
+static bool snull_bench_xmit(struct net_device *dev, struct sk_buff *skb,
+		bool more)
+{
+	struct netdev_queue *txq = skb_get_tx_queue(dev, skb);
+	netdev_tx_t ret;
+
+	for (;;) {
+		ret = NETDEV_TX_BUSY;
+		local_bh_disable();
+		HARD_TX_LOCK(dev, txq, smp_processor_id());
+		if (!netif_xmit_frozen_or_drv_stopped(txq))
+			ret = netdev_start_xmit(skb, dev, txq, more);
+		HARD_TX_UNLOCK(dev, txq);
+		local_bh_enable();
+		if (ret == NETDEV_TX_OK)
+			return true;
+		if (signal_pending(current))
+			return false;
+		cond_resched();
+	}
+}
+
+/*
+ * A run: send 'count' frames in bursts from this CPU's TX queue, as
+ * fast as the ring takes them, then give the sink a moment to see the
+ * last ones. The latency histogram is cleared and switched on for the
+ * duration. A signal stops the run at the end of a burst.
+ */
+static int snull_bench_run(void)
+{
+	struct snull_bench *b = &snull_bench;
+	struct sk_buff *burst[SNULL_BENCH_MAX_BURST];
+	u64 count[SNULL_LAT_BUCKETS] = {};
+	u64 sent = 0, received = 0, total, t0, t1;
+	struct net_device *dev, *sink;
+	unsigned int i, n, size, flows;
+	int lat_was, cpu, err = 0;
+	unsigned long deadline;
+	u16 qidx;
+
+	if (b->dev >= num_devs)
+		return -ENODEV;
+	/* The sink is the pair peer; an odd switch port count has no last one */
+	if ((b->dev ^ 1) >= num_devs)
+		return -EINVAL;
+	dev = snull_devs[b->dev];
+	sink = snull_devs[b->dev ^ 1];
+	if (!netif_running(dev) || !netif_running(sink))
+		return -ENETDOWN;
+	size = clamp_t(u32, b->size, ETH_ZLEN, ETH_HLEN + dev->mtu);
+	b->size = size;
+	b->burst = clamp_t(u32, b->burst, 1, SNULL_BENCH_MAX_BURST);
+	flows = max(b->flows, 1U);
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&snull_bench_rx, cpu), 0,
+		       sizeof(struct snull_bench_sink));
+	snull_lat_reset();
+	lat_was = READ_ONCE(lat_hist);
+	WRITE_ONCE(lat_hist, 1);
+	WRITE_ONCE(b->sink, sink);
+
+	t0 = ktime_get_ns();
+	while (sent < b->count && !signal_pending(current)) {
+		qidx = raw_smp_processor_id() % dev->real_num_tx_queues;
+		n = min_t(u64, b->burst, b->count - sent);
+		for (i = 0; i < n; i++) {
+			burst[i] = snull_bench_skb(dev, sink,
+					1024 + (sent + i) % flows, qidx);
+			if (!burst[i])
+				break;
+		}
+		if (i < n) {
+			while (i--)
+				kfree_skb(burst[i]);
+			err = -ENOMEM;
+			break;
+		}
+		for (i = 0; i < n; i++)
+			if (!snull_bench_xmit(dev, burst[i], i < n - 1))
+				break;
+		sent += i;
+		while (i < n)
+			kfree_skb(burst[i++]);
+		cond_resched();
+	}
+	t1 = ktime_get_ns();
+
+	/* Frames may still be on the wire or waiting for NAPI */
+	for (deadline = jiffies + HZ; time_before(jiffies, deadline); ) {
+		total = 0;
+		for_each_possible_cpu(cpu)
+			total += READ_ONCE(per_cpu(snull_bench_rx, cpu).packets);
+		if (total >= sent)
+			break;
+		if (total != received)
+			deadline = jiffies + HZ / 10;	/* still coming */
+		received = total;
+		msleep(1);
+	}
+	WRITE_ONCE(b->sink, NULL);
+	WRITE_ONCE(lat_hist, lat_was);
+
+	b->sent = sent;
+	b->received = 0;
+	for_each_possible_cpu(cpu)
+		b->received += per_cpu(snull_bench_rx, cpu).packets;
+	b->time_ns = max(t1 - t0, 1ULL);
+	total = snull_lat_sum(count);
+	b->p50_ns = snull_lat_percentile(count, total, 500);
+	b->p99_ns = snull_lat_percentile(count, total, 990);
+	b->p999_ns = snull_lat_percentile(count, total, 999);
+	return err;
+}
+
+/*
+ * The report: rates over the time it took to send, Gbps counting the
+ * frames (Ethernet header, no FCS), and drops as sent minus received.
+ */
+static int snull_bench_show(struct seq_file *m, void *v)
+{
+	struct snull_bench *b = &snull_bench;
+	u64 kpps, mbps;
+
+	/* Nothing to report before a run has sent something */
+	if (!b->sent || !b->time_ns)
+		return 0;
+	kpps = mul_u64_u64_div_u64(b->received, NSEC_PER_MSEC, b->time_ns);
+	mbps = mul_u64_u64_div_u64(b->received * b->size, 8000, b->time_ns);
+	seq_printf(m, "size: %u\n", b->size);
+	seq_printf(m, "burst: %u\n", b->burst);
+	seq_printf(m, "flows: %u\n", b->flows);
+	seq_printf(m, "sent: %llu\n", b->sent);
+	seq_printf(m, "received: %llu\n", b->received);
+	seq_printf(m, "dropped: %llu\n", b->sent - min(b->received, b->sent));
+	seq_printf(m, "time_ns: %llu\n", b->time_ns);
+	seq_printf(m, "mpps: %llu.%03llu\n", kpps / 1000, kpps % 1000);
+	seq_printf(m, "gbps: %llu.%03llu\n", mbps / 1000, mbps % 1000);
+	seq_printf(m, "p50_ns: %llu\n", b->p50_ns);
+	seq_printf(m, "p99_ns: %llu\n", b->p99_ns);
+	seq_printf(m, "p999_ns: %llu\n", b->p999_ns);
+	return 0;
+}
+
+static int snull_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, snull_bench_show, NULL);
+}
+
+/* Writing anything runs the benchmark; the write returns when it is over */
+static ssize_t snull_bench_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos)
+{
+	int err;
+
+	if (mutex_lock_interruptible(&snull_bench_mutex))
+		return -EINTR;
+	err = snull_bench_run();
+	mutex_unlock(&snull_bench_mutex);
+	return err ? err : count;
+}
+
+static const struct file_operations snull_bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= snull_bench_open,
+	.read		= seq_read,
+	.write		= snull_bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void snull_cleanup(void)
+{
+	struct snull_priv *priv;
+	int i, j;
     
-	for (i = 0; i < 2;  i++) {
-		if (snull_devs[i]) {
+	if (!snull_devs)
+		goto out;
+	/*
+	 * Take all devices down before freeing any: frames on one device's
+	 * emulated link may still be on their way to another.
+	 */
+	for (i = 0; i < num_devs;  i++)
+		if (snull_devs[i] && snull_devs[i]->reg_state == NETREG_REGISTERED)
 			unregister_netdev(snull_devs[i]);
-			snull_teardown_pool(snull_devs[i]);
+	for (i = 0; i < num_devs;  i++) {
+		if (snull_devs[i]) {
+			priv = netdev_priv(snull_devs[i]);
+			for (j = 0; j < priv->max_queues; j++) {
+				hrtimer_cancel(&priv->queues[j].coal_timer);
+				kvfree(priv->queues[j].wire);
+				snull_teardown_page_pool(&priv->queues[j]);
+				snull_teardown_pool(&priv->queues[j]);
+			}
+			free_percpu(priv->pcpu_stats);
 			free_netdev(snull_devs[i]);
 		}
 	}
+	kfree(snull_devs);
+	snull_devs = NULL;
+  out:
+	debugfs_remove_recursive(snull_debugfs);
+	snull_debugfs = NULL;
+	if (snull_pdev)
+		platform_device_unregister(snull_pdev);
 	printk ("%s: unregistered.\n", DRVNAME);
 	return;
 }
 
 static int snull_init_module(void)
 {
-	int result, i, ret = -ENOMEM;
+	struct snull_priv *priv;
+	int i, ret = -ENOMEM;
 
-	snull_interrupt = use_napi ? snull_napi_interrupt : snull_regular_interrupt;
+	/* A full-sized frame plus headroom and skb_shared_info fits a page */
+	BUILD_BUG_ON(SNULL_RX_HEADROOM + ETH_FRAME_LEN + SNULL_RX_SHINFO > PAGE_SIZE);
 
-	/* Allocate the devices:
-	#define alloc_netdev(sizeof_priv, name, setup) \
-        alloc_netdev_mq(sizeof_priv, name, setup, 1)
-	In alloc_netdev_mq():
+	snull_interrupt = use_napi ? snull_napi_interrupt : snull_regular_interrupt;
+	num_queues = clamp(num_queues, 1, SNULL_MAX_QUEUES);
+	max_queues = clamp_t(int, num_online_cpus(), num_queues, SNULL_MAX_QUEUES);
+	pool_size = roundup_pow_of_two(clamp(pool_size, 2, SNULL_MAX_POOL_SIZE));
+	num_devs = clamp(num_devs, 2, SNULL_MAX_DEVS);
+	if (!l2_switch)
+		num_devs = round_up(num_devs, 2);	/* whole pairs */
+	max_mtu = clamp(max_mtu, ETH_DATA_LEN, SNULL_MAX_MTU);
+	snull_rx_order = get_order(SNULL_RX_HEADROOM + ETH_HLEN + max_mtu +
+				   SNULL_RX_SHINFO);
+
+	/* Our "bus": no real DMA happens, but AF_XDP needs to map against it */
+	snull_pdev = platform_device_register_simple(DRVNAME, -1, NULL, 0);
+	if (IS_ERR(snull_pdev)) {
+		ret = PTR_ERR(snull_pdev);
+		snull_pdev = NULL;
+		return ret;
+	}
+	dma_coerce_mask_and_coherent(&snull_pdev->dev, DMA_BIT_MASK(64));
+
+	/* Nothing to do if debugfs is missing: the histogram just can't be read */
+	snull_debugfs = debugfs_create_dir(DRVNAME, NULL);
+	debugfs_create_file("latency", 0600, snull_debugfs, NULL, &snull_lat_fops);
+	debugfs_create_file("bench", 0600, snull_debugfs, NULL, &snull_bench_fops);
+	debugfs_create_u32("bench_dev", 0600, snull_debugfs, &snull_bench.dev);
+	debugfs_create_u32("bench_size", 0600, snull_debugfs, &snull_bench.size);
+	debugfs_create_u32("bench_burst", 0600, snull_debugfs, &snull_bench.burst);
+	debugfs_create_u32("bench_count", 0600, snull_debugfs, &snull_bench.count);
+	debugfs_create_u32("bench_flows", 0600, snull_debugfs, &snull_bench.flows);
+
+	/* Allocate the devices, with one TX and one RX queue per queue pair:
+	alloc_netdev_mqs(sizeof_priv, name, name_assign_type, setup, txqs, rxqs)
 	@setup:         callback to initialize device
+	The private area carries the queues[] array, so size it accordingly.
 	*/
-	snull_devs[0] = alloc_netdev(sizeof(struct snull_priv), "sn%d",
-			snull_init);
-	snull_devs[1] = alloc_netdev(sizeof(struct snull_priv), "sn%d",
-			snull_init);
-	if (snull_devs[0] == NULL || snull_devs[1] == NULL)
+	snull_devs = kcalloc(num_devs, sizeof(*snull_devs), GFP_KERNEL);
+	if (!snull_devs)
 		goto out;
+	for (i = 0; i < num_devs;  i++) {
+		snull_devs[i] = alloc_netdev_mqs(struct_size_t(struct snull_priv, queues, max_queues),
+				"sn%d", NET_NAME_UNKNOWN, snull_init, max_queues, max_queues);
+		if (snull_devs[i] == NULL)
+			goto out;
+		priv = netdev_priv(snull_devs[i]);
+		/* ndo_get_stats64 reads them even while the device is down */
+		if (!priv->pcpu_stats) {
+			printk (KERN_NOTICE "%s: Ran out of memory allocating statistics\n", DRVNAME);
+			goto out;
+		}
+		priv->index = i;
+		/* Not registered yet, so this can't fail */
+		netif_set_real_num_queues(snull_devs[i], num_queues, num_queues);
+	}
 
-	ret = -ENODEV;
-	for (i = 0; i < 2;  i++)
-		if ((result = register_netdev(snull_devs[i])))
+	/*
+	 * Every peer and switch port must exist before any device comes
+	 * up, so registering is all or nothing.
+	 */
+	for (i = 0; i < num_devs;  i++)
+		if ((ret = register_netdev(snull_devs[i]))) {
 			printk("%s: error %i registering device \"%s\"\n",
-					DRVNAME, result, snull_devs[i]->name);
-		else
-			ret = 0;
+					DRVNAME, ret, snull_devs[i]->name);
+			break;
+		}
+
+	/* Move NAPI polling into kthreads, as the threaded sysfs knob does */
+	if (!ret && napi_threaded) {
+		rtnl_lock();
+		for (i = 0; i < num_devs;  i++)
+			if (dev_set_threaded(snull_devs[i], true))
+				printk(KERN_NOTICE "%s: no NAPI threads for \"%s\"\n",
+						DRVNAME, snull_devs[i]->name);
+		rtnl_unlock();
+	}
    out:
 	if (ret) 
 		snull_cleanup();
@@ -66,5 +66,45 @@
 /* Default timeout period */
 #define SNULL_TIMEOUT 5   /* In jiffies */
 
-extern struct net_device *snull_devs[];
+/* Upper bound on the num_queues module parameter */
+#define SNULL_MAX_QUEUES 64
+
+/* Upper bound on the pool_size module parameter (descriptors per queue) */
+#define SNULL_MAX_POOL_SIZE 4096
+
+/* Interrupt moderation (ethtool -C) limits */
+#define SNULL_COAL_MAX_USECS 10000
+/* Range and "busy" batch size for adaptive moderation */
+#define SNULL_COAL_ADAPT_MIN_USECS 8
+#define SNULL_COAL_ADAPT_MAX_USECS 256
+#define SNULL_COAL_ADAPT_BATCH 16
+
+/* Upper bound on the emulated link's delay and jitter (sysfs link/) */
+#define SNULL_LINK_MAX_DELAY_US 200000
+
+/* Frames an emulated link holds in flight by default (link/limit), and at most */
+#define SNULL_LINK_LIMIT 1000
+#define SNULL_LINK_MAX_LIMIT 1000000
+
+/* Upper bound on the num_devs module parameter; keeps "\0SNULx" unique */
+#define SNULL_MAX_DEVS 200
+
+/* Longest headers our TSO engine takes; beyond that, software GSO */
+#define SNULL_TSO_MAX_HDR 256
+
+/* Upper bound on the max_mtu module parameter: the largest IP packet */
+#define SNULL_MAX_MTU 65535
+
+/* RSS (ethtool -x/-X): Toeplitz key length and indirection table size */
+#define SNULL_RSS_KEY_SIZE 40
+#define SNULL_RSS_INDIR_SIZE 128
+
+/* Log2 buckets of the TX-to-RX latency histogram (debugfs snull/latency) */
+#define SNULL_LAT_BUCKETS 64
+
+/* Packet generator (debugfs snull/bench): UDP port the sink takes, burst cap */
+#define SNULL_BENCH_PORT 9
+#define SNULL_BENCH_MAX_BURST 256
+
+extern struct net_device **snull_devs;
 
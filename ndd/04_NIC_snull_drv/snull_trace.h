@@ -0,0 +1,162 @@
+/*
+ * snull_trace.h -- tracepoints along the snull data path
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form, so long as an
+ * acknowledgment appears in derived source files.  No warranty
+ * is attached; we cannot take responsibility for errors or
+ * fitness for use.
+ *
+ * A frame goes through them in this order: snull_xmit when the stack
+ * hands the skb over, snull_hw_tx when the TX engine sends it,
+ * snull_rx_enqueue when it lands on a receive queue, snull_irq for the
+ * (moderated) interrupt, snull_napi_poll for each poll, and
+ * snull_rx_deliver when its skb goes up the stack. They cost a patched
+ * out branch each while disabled:
+ *
+ *   echo 1 > /sys/kernel/tracing/events/snull/enable
+ *   cat /sys/kernel/tracing/trace_pipe
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM snull
+
+#if !defined(_SNULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SNULL_TRACE_H
+
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(snull_skb,
+
+	TP_PROTO(const struct net_device *dev, u16 queue, const struct sk_buff *skb),
+
+	TP_ARGS(dev, queue, skb),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev->name	)
+		__field(	u16,		queue		)
+		__field(	const void *,	skbaddr		)
+		__field(	unsigned int,	len		)
+		__field(	u16,		gso_segs	)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->queue = queue;
+		__entry->skbaddr = skb;
+		__entry->len = skb->len;
+		__entry->gso_segs = skb_shinfo(skb)->gso_segs;
+	),
+
+	TP_printk("dev=%s queue=%u skbaddr=%p len=%u gso_segs=%u",
+		  __get_str(name), __entry->queue, __entry->skbaddr,
+		  __entry->len, __entry->gso_segs)
+);
+
+/* ndo_start_xmit entry */
+DEFINE_EVENT(snull_skb, snull_xmit,
+	TP_PROTO(const struct net_device *dev, u16 queue, const struct sk_buff *skb),
+	TP_ARGS(dev, queue, skb)
+);
+
+/* The TX engine fetches the skb and puts it on the wire */
+DEFINE_EVENT(snull_skb, snull_hw_tx,
+	TP_PROTO(const struct net_device *dev, u16 queue, const struct sk_buff *skb),
+	TP_ARGS(dev, queue, skb)
+);
+
+/* The received skb goes up the stack (GRO, netif_receive_skb or netif_rx) */
+DEFINE_EVENT(snull_skb, snull_rx_deliver,
+	TP_PROTO(const struct net_device *dev, u16 queue, const struct sk_buff *skb),
+	TP_ARGS(dev, queue, skb)
+);
+
+/* A frame was written into a receive buffer of 'queue' */
+TRACE_EVENT(snull_rx_enqueue,
+
+	TP_PROTO(const struct net_device *dev, u16 queue, unsigned int len,
+		 u32 hash),
+
+	TP_ARGS(dev, queue, len, hash),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev->name	)
+		__field(	u16,		queue		)
+		__field(	unsigned int,	len		)
+		__field(	u32,		hash		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->queue = queue;
+		__entry->len = len;
+		__entry->hash = hash;
+	),
+
+	TP_printk("dev=%s queue=%u len=%u hash=0x%08x",
+		  __get_str(name), __entry->queue, __entry->len, __entry->hash)
+);
+
+/* The simulated interrupt handler runs, with the status word it found */
+TRACE_EVENT(snull_irq,
+
+	TP_PROTO(const struct net_device *dev, u16 queue, int status),
+
+	TP_ARGS(dev, queue, status),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev->name	)
+		__field(	u16,		queue		)
+		__field(	int,		status		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->queue = queue;
+		__entry->status = status;
+	),
+
+	TP_printk("dev=%s queue=%u status=%s%s",
+		  __get_str(name), __entry->queue,
+		  __entry->status & SNULL_RX_INTR ? "RX " : "",
+		  __entry->status & SNULL_TX_INTR ? "TX" : "")
+);
+
+/* One NAPI poll: frames received, and AF_XDP frames sent */
+TRACE_EVENT(snull_napi_poll,
+
+	TP_PROTO(const struct net_device *dev, u16 queue, int budget,
+		 int rx_work, int tx_work),
+
+	TP_ARGS(dev, queue, budget, rx_work, tx_work),
+
+	TP_STRUCT__entry(
+		__string(	name,		dev->name	)
+		__field(	u16,		queue		)
+		__field(	int,		budget		)
+		__field(	int,		rx_work		)
+		__field(	int,		tx_work		)
+	),
+
+	TP_fast_assign(
+		__assign_str(name, dev->name);
+		__entry->queue = queue;
+		__entry->budget = budget;
+		__entry->rx_work = rx_work;
+		__entry->tx_work = tx_work;
+	),
+
+	TP_printk("dev=%s queue=%u budget=%d rx_work=%d tx_work=%d",
+		  __get_str(name), __entry->queue, __entry->budget,
+		  __entry->rx_work, __entry->tx_work)
+);
+
+#endif /* _SNULL_TRACE_H */
+
+/* This part must be outside the include guard; the Makefile adds -I$(src) */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE snull_trace
+#include <trace/define_trace.h>